@@ -117,6 +117,22 @@ bstack_count(bstack_t *q)
     return q->cc;
 }
 
+size_t
+bstack_pushed(bstack_t *q)
+{
+    return q->n;
+}
+
+void *
+bstack_get(bstack_t *q, size_t n)
+{
+    /* The item from the nth push, if not yet recycled */
+    if (n >= q->n || q->n - n > q->cc)
+        return NULL;
+    size_t idx = n % q->c;
+    return q->b + (idx * q->z);
+}
+
 void *
 bstack_next(bstack_t *q)
 {
@@ -47,6 +47,8 @@ void * bstack_push(bstack_t *q, void *item);
 void bstack_drop(bstack_t *q);
 void * bstack_top(bstack_t *q);
 size_t bstack_count(bstack_t *q);
+size_t bstack_pushed(bstack_t *q);
+void * bstack_get(bstack_t *q, size_t n);
 
 /* iteration */
 void * bstack_next(bstack_t *q);
@@ -0,0 +1,87 @@
+/*
+Copyright (c) 2018, The Monero Project
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Difficulty checks and stratum targets without big number arithmetic.
+
+  A hash (a 256 bit little endian number) meets a difficulty when
+  floor((2^256 - 1) / hash) >= difficulty, which is the same as
+  hash * difficulty < 2^256, and that only needs 64x64 bit multiplies.
+*/
+
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "util.h"
+
+static inline bool
+check_hash(const unsigned char *hash, uint64_t difficulty)
+{
+    uint64_t w[4];
+    unsigned __int128 m;
+    uint64_t top, carry;
+    memcpy(w, hash, sizeof(w));
+    m = (unsigned __int128) w[3] * difficulty;
+    if (m >> 64)
+        return false;
+    top = (uint64_t) m;
+    m = (unsigned __int128) w[0] * difficulty;
+    carry = (uint64_t) (m >> 64);
+    m = (unsigned __int128) w[1] * difficulty + carry;
+    carry = (uint64_t) (m >> 64);
+    m = (unsigned __int128) w[2] * difficulty + carry;
+    carry = (uint64_t) (m >> 64);
+    return carry <= UINT64_MAX - top;
+}
+
+static inline void
+target_to_hex(uint64_t target, char *target_hex)
+{
+    /*
+      Miners are sent the top 32 bits of (2^256 - 1) / target, which works
+      out as (2^32 - 1) / target. Targets too high for that are sent as is.
+    */
+    if (target & 0xFFFFFFFF00000000)
+    {
+        bin_to_hex((const unsigned char*)&target, 8, &target_hex[0]);
+        target_hex[16] = 0;
+        return;
+    }
+    uint32_t w = target ? 0xFFFFFFFF / (uint32_t) target : 0xFFFFFFFF;
+    bin_to_hex((const unsigned char*)&w, 4, &target_hex[0]);
+    target_hex[8] = 0;
+}
+
+#endif
@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2018, The Monero Project
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  An open addressing (linear probing) set. The first few keys live in the
+  slots held inline by the set itself, after which it spills into power of
+  two sized tables that are handed back to a free list per size when the
+  set is cleared, so a busy pool stops allocating once warmed up.
+
+  Zero marks an empty slot, so a zero key is tracked separately.
+*/
+
+#include "dupset.h"
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define DUPSET_CLASSES 24
+#define DUPSET_LOAD(n) ((n) - ((n) >> 2))
+
+typedef unsigned __int128 u128;
+
+static u128 *free_tables[DUPSET_CLASSES];
+static pthread_mutex_t mutex_tables = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned
+size_class(uint32_t size)
+{
+    return __builtin_ctz(size);
+}
+
+static u128 *
+table_get(uint32_t size)
+{
+    unsigned sc = size_class(size);
+    u128 *t = NULL;
+    pthread_mutex_lock(&mutex_tables);
+    if ((t = free_tables[sc]))
+        memcpy(&free_tables[sc], t, sizeof(u128*));
+    pthread_mutex_unlock(&mutex_tables);
+    if (!t)
+        t = (u128*) malloc(size * sizeof(u128));
+    memset(t, 0, size * sizeof(u128));
+    return t;
+}
+
+static void
+table_put(u128 *t, uint32_t size)
+{
+    unsigned sc = size_class(size);
+    if (sc >= DUPSET_CLASSES)
+    {
+        free(t);
+        return;
+    }
+    pthread_mutex_lock(&mutex_tables);
+    memcpy(t, &free_tables[sc], sizeof(u128*));
+    free_tables[sc] = t;
+    pthread_mutex_unlock(&mutex_tables);
+}
+
+static inline uint32_t
+slot_of(u128 key, uint32_t mask)
+{
+    uint64_t h = (uint64_t) key ^ (uint64_t) (key >> 64);
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (h >> 32) & mask;
+}
+
+static bool
+insert(u128 *t, uint32_t mask, u128 key)
+{
+    uint32_t i = slot_of(key, mask);
+    while (t[i])
+    {
+        if (t[i] == key)
+            return true;
+        i = (i + 1) & mask;
+    }
+    t[i] = key;
+    return false;
+}
+
+bool
+dupset_add(dupset_t *set, u128 key)
+{
+    if (!key)
+    {
+        bool had = set->zero;
+        set->zero = true;
+        return had;
+    }
+    u128 *t = set->table ? set->table : set->slots;
+    uint32_t size = set->table ? set->mask + 1 : DUPSET_INLINE;
+    if (insert(t, size - 1, key))
+        return true;
+    if (++set->count < DUPSET_LOAD(size))
+        return false;
+
+    /* Grow */
+    uint32_t ns = size << 1;
+    u128 *nt = table_get(ns);
+    for (uint32_t i=0; i<size; i++)
+    {
+        if (t[i])
+            insert(nt, ns - 1, t[i]);
+    }
+    if (set->table)
+        table_put(set->table, size);
+    else
+        memset(set->slots, 0, sizeof(set->slots));
+    set->table = nt;
+    set->mask = ns - 1;
+    return false;
+}
+
+void
+dupset_clear(dupset_t *set)
+{
+    if (set->table)
+        table_put(set->table, set->mask + 1);
+    memset(set, 0, sizeof(dupset_t));
+}
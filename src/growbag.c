@@ -226,3 +226,26 @@ gbag_next(gbag_t *gb, void* from)
     return NULL;
 }
 
+void *
+gbag_next_r(gbag_t *gb, void **cursor)
+{
+    /*
+      Like gbag_next, but the position is kept in the caller's cursor
+      (NULL to start), so walks don't disturb each other. Nothing may be
+      added to or removed from the bag during the walk.
+    */
+    char *e = gb->e;
+    char *s = *cursor ? (char*)*cursor : gb->b;
+    while (s < e)
+    {
+        char *c = s;
+        s += gb->z;
+        if (gbag_occupied(gb, c))
+        {
+            *cursor = s;
+            return c;
+        }
+    }
+    *cursor = s;
+    return NULL;
+}
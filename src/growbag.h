@@ -53,5 +53,6 @@ void * gbag_find(gbag_t *gb, const void *key, gbag_cmp cmp);
 void * gbag_find_after(gbag_t *gb, const void *key, gbag_cmp cmp, void* from);
 void * gbag_first(gbag_t *gb);
 void * gbag_next(gbag_t *gb, void* from);
+void * gbag_next_r(gbag_t *gb, void **cursor);
 
 #endif
@@ -0,0 +1,143 @@
+/*
+Copyright (c) 2018, The Monero Project
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  A bounded array queue where each cell carries a sequence number that tells
+  producers and consumers whose turn it is to use the cell. Both ends only
+  ever CAS their own position counter, so neither side takes a lock.
+*/
+
+#include "lfq.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define CACHE_LINE 64
+
+typedef struct lfq_cell_t
+{
+    size_t seq;
+    void *item;
+} lfq_cell_t;
+
+struct lfq_t
+{
+    lfq_cell_t *c;
+    size_t m;
+    char pad0[CACHE_LINE];
+    size_t e;
+    char pad1[CACHE_LINE];
+    size_t d;
+    char pad2[CACHE_LINE];
+};
+
+void
+lfq_new(lfq_t **out, size_t count)
+{
+    lfq_t *q = (lfq_t*) calloc(1, sizeof(lfq_t));
+    size_t z = 2;
+    while (z < count)
+        z <<= 1;
+    q->c = (lfq_cell_t*) calloc(z, sizeof(lfq_cell_t));
+    for (size_t i=0; i<z; i++)
+        q->c[i].seq = i;
+    q->m = z - 1;
+    q->e = 0;
+    q->d = 0;
+    *out = q;
+}
+
+void
+lfq_free(lfq_t *q)
+{
+    free(q->c);
+    free(q);
+}
+
+int
+lfq_push(lfq_t *q, void *item)
+{
+    lfq_cell_t *cell;
+    size_t pos = __atomic_load_n(&q->e, __ATOMIC_RELAXED);
+    while (1)
+    {
+        cell = &q->c[pos & q->m];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->e, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+            return -1;
+        else
+            pos = __atomic_load_n(&q->e, __ATOMIC_RELAXED);
+    }
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *
+lfq_pop(lfq_t *q)
+{
+    lfq_cell_t *cell;
+    size_t pos = __atomic_load_n(&q->d, __ATOMIC_RELAXED);
+    while (1)
+    {
+        cell = &q->c[pos & q->m];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->d, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+            return NULL;
+        else
+            pos = __atomic_load_n(&q->d, __ATOMIC_RELAXED);
+    }
+    void *item = cell->item;
+    __atomic_store_n(&cell->seq, pos + q->m + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+size_t
+lfq_size(lfq_t *q)
+{
+    size_t e = __atomic_load_n(&q->e, __ATOMIC_RELAXED);
+    size_t d = __atomic_load_n(&q->d, __ATOMIC_RELAXED);
+    return e > d ? e - d : 0;
+}
@@ -46,6 +46,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -57,33 +58,50 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <inttypes.h>
 
 #include <json-c/json.h>
-#include <openssl/bn.h>
 #include <pthread.h>
 
 #include "bstack.h"
+#include "diff.h"
+#include "dupset.h"
+#include "rx.h"
+#include "slab.h"
+#include "stratum.h"
 #include "util.h"
 #include "xmr.h"
 #include "log.h"
 #include "webui.h"
 #include "forkoff.h"
 #include "growbag.h"
+#include "wpool.h"
 #include "uthash.h"
 
 #define MAX_LINE 8192
 #define CLIENTS_INIT 8192
 #define RPC_BODY_MAX 65536
-#define JOB_BODY_MAX 8192
 #define ERROR_BODY_MAX 512
 #define STATUS_BODY_MAX 512
 #define CLIENT_JOBS_MAX 4
+#define JOB_ID_SIZE 16
+#define SUBMISSIONS_SLAB 1024
+#define BROADCAST_SLAB 4096
+#define BROADCAST_QUEUE_MAX 65536
+#define JOB_BODY_CUTS 8
+#define SLOT_MARK '\x01'
+#define MARK_JSON_ID "\x01" "0"
+#define MARK_CLIENT_ID "\x01" "1"
+#define MARK_JOB_ID "\x01" "2"
+#define MARK_TARGET "\x01" "3"
+#define MARK_TARGET_DIFF "\x01" "4"
+#define MARK_BLOB "\x01" "5"
+#define MARK_RESERVED "\x01" "6"
+#define MARK_EXTRA_NONCE "\x01" "7"
 #define BLOCK_HEADERS_MAX 4
 #define BLOCK_TEMPLATES_MAX 4
 #define MAINNET_ADDRESS_PREFIX 18
 #define TESTNET_ADDRESS_PREFIX 53
-#define BLOCK_HEADERS_RANGE 10
 #define DB_INIT_SIZE 0x140000000 /* 5G */
 #define DB_GROW_SIZE 0xA0000000 /* 2.5G */
-#define DB_COUNT_MAX 10
+#define DB_COUNT_MAX 16
 #define MAX_PATH 1024
 #define RPC_PATH "/json_rpc"
 #define ADDRESS_MAX 128
@@ -94,6 +112,17 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define MAX_DOWNSTREAM 8
 #define MAX_HOST 256
 #define MAX_RIG_ID 32
+#define SHARE_BUFFER_INIT 256
+#define CLIENT_PENDING_MAX 32
+#define VERIFY_QUEUE_MAX 4096
+#define VALIDATE_QUEUE_MAX 1024
+#define SCHEMA_VERSION 5
+#define MIGRATE_SHARES_MAX 50000
+#define CHECKPOINT_INTERVAL 60
+#define CHECKPOINT_ROWS_MAX 50000
+#define ROUND_TAIL_HEIGHTS 10
+#define CULL_ROWS_MAX 20000
+#define CULL_SLICE_US 50000
 
 #define uint128_t unsigned __int128
 
@@ -111,31 +140,54 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 /*
-  Tables:
+  Tables (schema version 5):
+
+  Addresses
+  ---------
+  address id <-> wallet addr
+  wallet addr <-> address id (address_ids)
 
   Shares
   ------
-  height <-> share_t
+  height <-> share_rec_t
+
+  Share rollups
+  -------------
+  rollup_key_t (height, address id, share difficulty) <-> rollup_t
 
   Blocks
   ------
   height <-> block_t
+  height <-> block hash, whilst BLOCK_LOCKED (locked_blocks)
 
   Balance
   -------
-  wallet addr <-> balance
+  address id <-> balance
 
   Payments
   --------
-  wallet addr <-> payment_t
+  address id <-> payment_rec_t
+
+  Account stats
+  -------------
+  address id <-> account_stats_t
 
   Properties
   ----------
   name <-> value
+  "round_checkpoint" <-> round_checkpoint_t
+
+  Version 1 keyed balances and payments by a zero padded address and stored
+  a full share_t per share. Balances and payments are converted when the
+  database is opened; shares are moved over a height at a time, newest
+  first, by timer_on_migrate whilst the pool runs. Version 2 had no share
+  rollups, and versions 3 and 4 rolled up per address only (share_rollups);
+  timer_on_migrate builds them for existing heights the same way.
 */
 
 enum block_status { BLOCK_LOCKED, BLOCK_UNLOCKED, BLOCK_ORPHANED };
 enum stratum_mode { MODE_NORMAL, MODE_SELF_SELECT };
+enum submit_status { SUBMIT_PENDING, SUBMIT_OK, SUBMIT_INVALID };
 enum msgbin_type  { BIN_PING, BIN_CONNECT, BIN_DISCONNECT, BIN_SHARE,
                     BIN_BLOCK, BIN_STATS, BIN_BALANCE };
 const unsigned char msgbin[] = {0x4D,0x4E,0x52,0x4F,0x50,0x4F,0x4F,0x4C};
@@ -193,14 +245,59 @@ typedef struct config_t
     int processes;
     int32_t cull_shares;
     uint32_t template_timeout;
+    uint32_t verify_threads;
+    bool verify_numa;
+    uint32_t broadcast_threads;
+    uint32_t stratum_threads;
+    bool rx_dataset_save;
+    uint32_t share_commit_batch;
+    uint32_t share_commit_latency;
 } config_t;
 
+enum job_slot
+{
+    SLOT_JSON_ID,
+    SLOT_CLIENT_ID,
+    SLOT_JOB_ID,
+    SLOT_TARGET,
+    SLOT_TARGET_DIFF,
+    SLOT_BLOB,
+    SLOT_RESERVED,
+    SLOT_EXTRA_NONCE,
+    SLOT_MAX
+};
+
+enum job_body
+{
+    JOB_BODY_NOTIFY,
+    JOB_BODY_RESPONSE,
+    JOB_BODY_PROXY_NOTIFY,
+    JOB_BODY_PROXY_RESPONSE,
+    JOB_BODY_MAX
+};
+
+typedef struct job_body_t
+{
+    char *text;
+    size_t size;
+    size_t cut[JOB_BODY_CUTS];
+    uint8_t slot[JOB_BODY_CUTS];
+    unsigned cuts;
+} job_body_t;
+
+typedef struct job_slots_t
+{
+    const char *value[SLOT_MAX];
+    size_t size[SLOT_MAX];
+} job_slots_t;
+
 typedef struct block_template_t
 {
     char *hashing_blob;
     size_t hashing_blob_size;
     char *block_blob;
     size_t block_blob_size;
+    char *block_hex;
     uint64_t difficulty;
     uint64_t height;
     char prev_hash[65];
@@ -208,20 +305,74 @@ typedef struct block_template_t
     char seed_hash[65];
     char next_seed_hash[65];
     uint64_t tx_count;
+    hashing_template_t *hashing_template;
+    job_body_t job_bodies[JOB_BODY_MAX];
 } block_template_t;
 
 typedef struct job_t
 {
-    uuid_t id;
-    char *blob;
+    unsigned char id[JOB_ID_SIZE];
     block_template_t *block_template;
     uint32_t extra_nonce;
     uint64_t target;
-    uint128_t *submissions;
-    size_t submissions_count;
+    char target_hex[17];
+    dupset_t submissions;
     block_template_t *miner_template;
+    unsigned char hashing_blob[HASHING_BLOB_MAX];
+    size_t hashing_blob_size;
 } job_t;
 
+typedef struct job_send_t
+{
+    int fd;
+    uint64_t serial;
+    uint64_t seq;
+    int json_id;
+    bool response;
+    bool is_xnp;
+    bool self_select;
+    char client_id[33];
+    unsigned char job_id[JOB_ID_SIZE];
+    uint64_t target;
+    char target_hex[17];
+    unsigned char reserved[8];
+    block_template_t *block_template;
+    unsigned char hashing_blob[HASHING_BLOB_MAX];
+    size_t hashing_blob_size;
+    struct evbuffer *body;
+} job_send_t;
+
+typedef struct reactor_t reactor_t;
+typedef struct account_t account_t;
+
+typedef struct submission_t submission_t;
+struct submission_t
+{
+    submission_t *next;
+    int fd;
+    uint64_t serial;
+    int json_id;
+    char job_id[33];
+    const char *error;
+    unsigned char *block;
+    size_t block_size;
+    unsigned char blob[HASHING_BLOB_MAX];
+    size_t blob_size;
+    uint8_t pow_variant;
+    unsigned char seed_hash[32];
+    unsigned char result_hash[32];
+    uint64_t height;
+    uint64_t difficulty;
+    char prev_hash[64];
+    uint64_t target;
+    char address[ADDRESS_MAX];
+    uint32_t address_id;
+    uint32_t status;
+    bool done;
+    bool orphaned;
+    block_template_t *miner_template;
+};
+
 typedef struct client_t
 {
     int fd;
@@ -229,7 +380,7 @@ typedef struct client_t
     uint16_t port;
     int json_id;
     struct bufferevent *bev;
-    char address[ADDRESS_MAX];
+    account_t *account;
     char worker_id[64];
     char client_id[32];
     char rig_id[MAX_RIG_ID];
@@ -245,18 +396,57 @@ typedef struct client_t
     bool downstream;
     uint32_t downstream_accounts;
     uint64_t req_diff;
+    uint64_t target;
+    char target_hex[17];
+    uint64_t serial;
+    submission_t *pending;
+    submission_t *pending_tail;
+    uint32_t pending_count;
+    reactor_t *reactor;
     UT_hash_handle hh;
 } client_t;
 
-typedef struct account_t
+typedef struct client_rank_t
+{
+    double hr;
+    client_t *client;
+} client_rank_t;
+
+struct reactor_t
+{
+    unsigned idx;
+    pthread_t thread;
+    struct event_base *base;
+    struct event *listener_event;
+    struct event *send_jobs;
+    wpool_t *verifier;
+    wpool_t *broadcaster;
+    wpool_t *validator;
+    slab_t *slab_submissions;
+    slab_t *slab_broadcast;
+    client_rank_t *broadcast_ranks;
+    size_t broadcast_ranks_max;
+    uint32_t broadcast_pending;
+    uint64_t broadcast_start;
+};
+
+struct account_t
 {
+    uint32_t id;
+    uint32_t hash;
     char address[ADDRESS_MAX];
+    uint32_t address_id;
     size_t worker_count;
     time_t connected_since;
     uint64_t hashes;
     hr_stats_t hr_stats;
-    UT_hash_handle hh;
-} account_t;
+};
+
+typedef struct account_slot_t
+{
+    uint32_t hash;
+    uint32_t id;
+} account_slot_t;
 
 typedef struct share_t
 {
@@ -266,6 +456,14 @@ typedef struct share_t
     time_t timestamp;
 } share_t;
 
+typedef struct share_rec_t
+{
+    uint64_t height;
+    uint64_t difficulty;
+    uint32_t address_id;
+    uint32_t timestamp;
+} share_rec_t;
+
 typedef struct block_t
 {
     uint64_t height;
@@ -284,6 +482,83 @@ typedef struct payment_t
     char address[ADDRESS_MAX];
 } payment_t;
 
+typedef struct rollup_key_t
+{
+    uint64_t height;
+    uint64_t address_id;
+    uint64_t share_difficulty;
+} rollup_key_t;
+
+typedef struct rollup_t
+{
+    uint64_t difficulty;
+    uint32_t first;
+    uint32_t last;
+} rollup_t;
+
+typedef struct rollup_entry_t
+{
+    uint64_t difficulty;
+    uint64_t share_difficulty;
+    uint32_t address_id;
+    uint32_t first;
+    uint32_t last;
+} rollup_entry_t;
+
+typedef struct rollup_buf_t
+{
+    rollup_entry_t *entries;
+    size_t count;
+    size_t max;
+    size_t rows;
+} rollup_buf_t;
+
+typedef struct round_checkpoint_t
+{
+    uint64_t block_height;
+    int64_t block_time;
+    uint64_t height;
+    uint64_t hashes;
+} round_checkpoint_t;
+
+typedef struct account_stats_t
+{
+    int64_t saved;
+    uint64_t hashes;
+    hr_stats_t hr_stats;
+} account_stats_t;
+
+typedef struct payment_rec_t
+{
+    uint64_t amount;
+    uint64_t timestamp;
+} payment_rec_t;
+
+typedef struct payout_sums_t
+{
+    uint64_t *amounts;
+    uint32_t max;
+    uint32_t *ids;
+    uint32_t count;
+    uint32_t ids_max;
+} payout_sums_t;
+
+typedef struct payout_run_t
+{
+    const block_t *block;
+    uint64_t paid;
+    uint64_t fee;
+    uint64_t rows;
+    payout_sums_t sums;
+} payout_run_t;
+
+typedef struct payout_t
+{
+    uint32_t address_id;
+    uint64_t amount;
+    char address[ADDRESS_MAX];
+} payout_t;
+
 typedef struct rpc_callback_t rpc_callback_t;
 typedef void (*rpc_callback_fun)(const char*, rpc_callback_t*);
 typedef void (*rpc_datafree_fun)(void*);
@@ -298,24 +573,37 @@ static config_t config;
 static bstack_t *bst;
 static bstack_t *bsh;
 static struct event_base *pool_base;
-static struct event *listener_event;
 static struct event *timer_30s;
 static struct event *timer_10m;
 static struct event *timer_template;
+static struct event *timer_shares;
 static struct event *signal_usr1;
 static time_t template_triggered;
 static uint32_t extra_nonce;
 static uint32_t instance_id;
-static block_t block_headers_range[BLOCK_HEADERS_RANGE];
 static MDB_env *env;
 static MDB_dbi db_shares;
 static MDB_dbi db_blocks;
 static MDB_dbi db_balance;
 static MDB_dbi db_payments;
 static MDB_dbi db_properties;
-static BN_CTX *bn_ctx;
-static BIGNUM *base_diff;
+static MDB_dbi db_addresses;
+static MDB_dbi db_address_ids;
+static MDB_dbi db_shares_v1;
+static MDB_dbi db_rollups;
+static MDB_dbi db_locked;
+static MDB_dbi db_account_stats;
+static time_t accounts_saved;
+static struct event *timer_checkpoint;
+static bool shares_v1;
+static bool migrating;
+static uint64_t migrate_floor;
+static uint32_t fee_address_id;
+static struct event *timer_migrate;
+static struct event *timer_cull;
+static time_t cull_cut;
 static pool_stats_t pool_stats;
+static pool_metrics_t pool_metrics;
 static unsigned clients_reading;
 static pthread_cond_t cond_clients = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t mutex_clients = PTHREAD_MUTEX_INITIALIZER;
@@ -323,6 +611,7 @@ static pthread_mutex_t mutex_log = PTHREAD_MUTEX_INITIALIZER;
 static pthread_rwlock_t rwlock_tx = PTHREAD_RWLOCK_INITIALIZER;
 static pthread_rwlock_t rwlock_acc = PTHREAD_RWLOCK_INITIALIZER;
 static pthread_rwlock_t rwlock_cfd = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t rwlock_tpl = PTHREAD_RWLOCK_INITIALIZER;
 static FILE *fd_log;
 static unsigned char sec_view[32];
 static unsigned char pub_spend[32];
@@ -336,12 +625,34 @@ static time_t upstream_last_time;
 static uint64_t upstream_last_height;
 static uint32_t account_count;
 static client_t *clients_by_fd = NULL;
-static account_t *accounts = NULL;
-static gbag_t *bag_accounts;
+static account_t **accounts;
+static uint32_t accounts_max;
+static uint32_t *account_ids_free;
+static uint32_t account_ids_free_count;
+static uint32_t accounts_next;
+static account_slot_t *account_index;
+static uint32_t account_index_size;
+static uint32_t account_index_used;
 static gbag_t *bag_clients;
 static bool abattoir;
-
-extern void rx_slow_hash_free_state();
+static uint64_t client_serial;
+static job_body_t job_bodies_ss[2];
+static reactor_t *reactors;
+static __thread reactor_t *reactor;
+static share_rec_t *share_buffer;
+static share_rec_t *share_spare;
+static size_t share_buffer_count;
+static size_t share_buffer_max;
+static size_t share_spare_max;
+static size_t share_buffer_held;
+static uint64_t share_buffer_since;
+static uint64_t started_us;
+static bool first_verified;
+static unsigned verify_nodes;
+static unsigned verifier_seq;
+static __thread int verifier_node = -1;
+static pthread_mutex_t mutex_shares = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t mutex_share_commit = PTHREAD_MUTEX_INITIALIZER;
 
 #define JSON_GET_OR_ERROR(name, parent, type, client)                \
     json_object *name = NULL;                                        \
@@ -490,6 +801,129 @@ compare_payment(const MDB_val *a, const MDB_val *b)
     return (va->timestamp < vb->timestamp) ? -1 : 1;
 }
 
+static int
+compare_share_rec(const MDB_val *a, const MDB_val *b)
+{
+    const share_rec_t *va = (const share_rec_t*) a->mv_data;
+    const share_rec_t *vb = (const share_rec_t*) b->mv_data;
+    return (va->timestamp < vb->timestamp) ? -1 : 1;
+}
+
+static int
+compare_rollup_key(const MDB_val *a, const MDB_val *b)
+{
+    const rollup_key_t *va = (const rollup_key_t*) a->mv_data;
+    const rollup_key_t *vb = (const rollup_key_t*) b->mv_data;
+    if (va->height != vb->height)
+        return va->height < vb->height ? -1 : 1;
+    if (va->address_id != vb->address_id)
+        return va->address_id < vb->address_id ? -1 : 1;
+    return va->share_difficulty < vb->share_difficulty ? -1
+        : va->share_difficulty > vb->share_difficulty;
+}
+
+static int
+compare_payment_rec(const MDB_val *a, const MDB_val *b)
+{
+    const payment_rec_t *va = (const payment_rec_t*) a->mv_data;
+    const payment_rec_t *vb = (const payment_rec_t*) b->mv_data;
+    return (va->timestamp < vb->timestamp) ? -1 : 1;
+}
+
+static int
+address_id_get(MDB_txn *txn, const char *address, bool create, uint32_t *id)
+{
+    /*
+      Ids are allocated sequentially from 1 and never reused, so a share
+      record always resolves to the address that earned it.
+    */
+    int rc = 0;
+    MDB_cursor *cursor = NULL;
+    size_t len = strnlen(address, ADDRESS_MAX);
+    if (!len || len == ADDRESS_MAX)
+        return EINVAL;
+    MDB_val k = {len, (void*)address};
+    MDB_val v;
+    if (!(rc = mdb_get(txn, db_address_ids, &k, &v)))
+    {
+        memcpy(id, v.mv_data, sizeof(uint32_t));
+        return 0;
+    }
+    if (rc != MDB_NOTFOUND || !create)
+        return rc;
+
+    uint32_t next = 1;
+    MDB_val ik, iv;
+    if ((rc = mdb_cursor_open(txn, db_addresses, &cursor)))
+        return rc;
+    if (!(rc = mdb_cursor_get(cursor, &ik, &iv, MDB_LAST)))
+    {
+        memcpy(&next, ik.mv_data, sizeof(uint32_t));
+        next++;
+    }
+    mdb_cursor_close(cursor);
+    if (rc && rc != MDB_NOTFOUND)
+        return rc;
+    ik.mv_size = sizeof(next);
+    ik.mv_data = &next;
+    if ((rc = mdb_put(txn, db_addresses, &ik, &k, MDB_APPEND)))
+        return rc;
+    if ((rc = mdb_put(txn, db_address_ids, &k, &ik, MDB_NOOVERWRITE)))
+        return rc;
+    *id = next;
+    return 0;
+}
+
+static int
+address_get(MDB_txn *txn, uint32_t id, char *address)
+{
+    int rc = 0;
+    MDB_val k = {sizeof(id), (void*)&id};
+    MDB_val v;
+    if ((rc = mdb_get(txn, db_addresses, &k, &v)))
+        return rc;
+    size_t len = MIN(v.mv_size, ADDRESS_MAX-1);
+    memcpy(address, v.mv_data, len);
+    address[len] = 0;
+    return 0;
+}
+
+static int
+address_id(const char *address, uint32_t *id)
+{
+    /*
+      Looks up the persistent id of an address, only taking a write txn
+      the first time an address is seen.
+    */
+    int rc = 0;
+    char *err = NULL;
+    MDB_txn *txn = NULL;
+    if ((rc = pdb_txn_begin(env, NULL, MDB_RDONLY, &txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        return rc;
+    }
+    rc = address_id_get(txn, address, false, id);
+    mdb_txn_abort(txn);
+    if (rc != MDB_NOTFOUND)
+        return rc;
+    if ((rc = pdb_txn_begin(env, NULL, 0, &txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        return rc;
+    }
+    if ((rc = address_id_get(txn, address, true, id)))
+    {
+        err = mdb_strerror(rc);
+        log_error("Cannot store address: %s", err);
+        mdb_txn_abort(txn);
+        return rc;
+    }
+    return mdb_txn_commit(txn);
+}
+
 static int
 database_resize(void)
 {
@@ -553,12 +987,199 @@ unlock:
     return rc;
 }
 
+static int
+database_upgrade(MDB_txn *txn, uint32_t version)
+{
+    /*
+      Converts a version 1 database. Balances and payments are small, so
+      are rewritten here; shares are left for timer_on_migrate, as are the
+      rollups version 3 added and version 5 split by share difficulty.
+      Version 4 indexed locked blocks, which is cheap enough to rebuild
+      here. Old tables are emptied rather than dropped, as other pool
+      processes may still hold their handles.
+    */
+    int rc = 0;
+    MDB_dbi dbi;
+    MDB_cursor *cursor = NULL;
+    MDB_val k, v;
+    char address[ADDRESS_MAX];
+    uint32_t id = 0;
+    size_t balances = 0, payments = 0;
+
+    if (version >= 2)
+        goto rollups;
+
+    if (!(rc = mdb_dbi_open(txn, "balance", 0, &dbi)))
+    {
+        mdb_set_compare(txn, dbi, compare_string);
+        if ((rc = mdb_cursor_open(txn, dbi, &cursor)))
+            return rc;
+        MDB_cursor_op op = MDB_FIRST;
+        while (!(rc = mdb_cursor_get(cursor, &k, &v, op)))
+        {
+            op = MDB_NEXT;
+            size_t len = strnlen(k.mv_data, MIN(k.mv_size, ADDRESS_MAX-1));
+            memcpy(address, k.mv_data, len);
+            address[len] = 0;
+            if ((rc = address_id_get(txn, address, true, &id)))
+                break;
+            k.mv_size = sizeof(id);
+            k.mv_data = &id;
+            if ((rc = mdb_put(txn, db_balance, &k, &v, 0)))
+                break;
+            balances++;
+        }
+        mdb_cursor_close(cursor);
+        if (rc != MDB_NOTFOUND || (rc = mdb_drop(txn, dbi, 0)))
+            return rc;
+    }
+    else if (rc != MDB_NOTFOUND)
+        return rc;
+
+    if (!(rc = mdb_dbi_open(txn, "payments", MDB_DUPSORT | MDB_DUPFIXED,
+                    &dbi)))
+    {
+        mdb_set_compare(txn, dbi, compare_string);
+        mdb_set_dupsort(txn, dbi, compare_payment);
+        if ((rc = mdb_cursor_open(txn, dbi, &cursor)))
+            return rc;
+        MDB_cursor_op op = MDB_FIRST;
+        while (!(rc = mdb_cursor_get(cursor, &k, &v, op)))
+        {
+            op = MDB_NEXT;
+            const payment_t *p = (const payment_t*) v.mv_data;
+            payment_rec_t pr = {p->amount, p->timestamp};
+            size_t len = strnlen(p->address, ADDRESS_MAX-1);
+            memcpy(address, p->address, len);
+            address[len] = 0;
+            if ((rc = address_id_get(txn, address, true, &id)))
+                break;
+            k.mv_size = sizeof(id);
+            k.mv_data = &id;
+            v.mv_size = sizeof(pr);
+            v.mv_data = &pr;
+            if ((rc = mdb_put(txn, db_payments, &k, &v, 0)))
+                break;
+            payments++;
+        }
+        mdb_cursor_close(cursor);
+        if (rc != MDB_NOTFOUND || (rc = mdb_drop(txn, dbi, 0)))
+            return rc;
+    }
+    else if (rc != MDB_NOTFOUND)
+        return rc;
+
+    if (!(rc = mdb_dbi_open(txn, "shares",
+                    MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED,
+                    &db_shares_v1)))
+    {
+        mdb_set_compare(txn, db_shares_v1, compare_uint64);
+        mdb_set_dupsort(txn, db_shares_v1, compare_share);
+        if ((rc = mdb_cursor_open(txn, db_shares_v1, &cursor)))
+            return rc;
+        if (!(rc = mdb_cursor_get(cursor, &k, &v, MDB_LAST)))
+        {
+            shares_v1 = true;
+            memcpy(&migrate_floor, k.mv_data, sizeof(uint64_t));
+            migrate_floor++;
+        }
+        mdb_cursor_close(cursor);
+        if (rc && rc != MDB_NOTFOUND)
+            return rc;
+    }
+    else if (rc != MDB_NOTFOUND)
+        return rc;
+
+    if (balances || payments)
+        log_info("Upgraded %zu balances and %zu payments to schema version "
+                "%u", balances, payments, SCHEMA_VERSION);
+
+rollups:
+    if (version >= 5)
+        goto locked;
+    if (version >= 3)
+    {
+        if (!(rc = mdb_dbi_open(txn, "share_rollups", 0, &dbi)))
+        {
+            if ((rc = mdb_drop(txn, dbi, 0)))
+                return rc;
+        }
+        else if (rc != MDB_NOTFOUND)
+            return rc;
+    }
+    if ((rc = mdb_cursor_open(txn, db_shares, &cursor)))
+        return rc;
+    if (!(rc = mdb_cursor_get(cursor, &k, &v, MDB_LAST)))
+    {
+        uint64_t height;
+        memcpy(&height, k.mv_data, sizeof(height));
+        migrate_floor = MAX(migrate_floor, height + 1);
+    }
+    mdb_cursor_close(cursor);
+    if (rc && rc != MDB_NOTFOUND)
+        return rc;
+    /* Resume from where an earlier run got to */
+    k.mv_data = "migrate_floor";
+    k.mv_size = strlen(k.mv_data);
+    if (!mdb_get(txn, db_properties, &k, &v))
+        memcpy(&migrate_floor, v.mv_data, sizeof(migrate_floor));
+
+locked:
+    if ((rc = mdb_drop(txn, db_locked, 0))
+            || (rc = mdb_cursor_open(txn, db_blocks, &cursor)))
+        return rc;
+    MDB_cursor_op op = MDB_FIRST;
+    while (!(rc = mdb_cursor_get(cursor, &k, &v, op)))
+    {
+        op = MDB_NEXT;
+        const block_t *block = (const block_t*) v.mv_data;
+        if (block->status != BLOCK_LOCKED)
+            continue;
+        MDB_val lv = {sizeof(block->hash), (void*)block->hash};
+        if ((rc = mdb_put(txn, db_locked, &k, &lv, MDB_NODUPDATA))
+                && rc != MDB_KEYEXIST)
+            break;
+    }
+    mdb_cursor_close(cursor);
+    if (rc != MDB_NOTFOUND)
+        return rc;
+
+    if (migrate_floor)
+    {
+        migrating = true;
+        log_info("Shares below height %"PRIu64" will be migrated in the "
+                "background", migrate_floor);
+        return 0;
+    }
+    version = SCHEMA_VERSION;
+    k.mv_data = "schema_version";
+    k.mv_size = strlen(k.mv_data);
+    v.mv_data = &version;
+    v.mv_size = sizeof(version);
+    return mdb_put(txn, db_properties, &k, &v, 0);
+}
+
 static int
 database_init(const char* data_dir)
 {
     int rc = 0;
     char *err = NULL;
     MDB_txn *txn = NULL;
+    const struct { const char *name; uint32_t flags; MDB_dbi *dbi; } dbs[] =
+    {
+        {"shares_v2", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED, &db_shares},
+        {"share_rollups_v2", 0, &db_rollups},
+        {"blocks", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED, &db_blocks},
+        {"locked_blocks", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED,
+            &db_locked},
+        {"payments_v2", MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED,
+            &db_payments},
+        {"balance_v2", MDB_INTEGERKEY, &db_balance},
+        {"addresses", MDB_INTEGERKEY, &db_addresses},
+        {"address_ids", 0, &db_address_ids},
+        {"account_stats", MDB_INTEGERKEY, &db_account_stats},
+        {"properties", 0, &db_properties},
+    };
 
     rc = mdb_env_create(&env);
     mdb_env_set_maxdbs(env, (MDB_dbi) DB_COUNT_MAX);
@@ -579,56 +1200,59 @@ database_init(const char* data_dir)
         log_fatal("%s", err);
         exit(rc);
     }
-    uint32_t flags = MDB_INTEGERKEY | MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED;
-    if ((rc = mdb_dbi_open(txn, "shares", flags, &db_shares)))
-    {
-        err = mdb_strerror(rc);
-        log_fatal("%s", err);
-        exit(rc);
-    }
-    if ((rc = mdb_dbi_open(txn, "blocks", flags, &db_blocks)))
+    for (size_t i=0; i<sizeof(dbs)/sizeof(dbs[0]); i++)
     {
-        err = mdb_strerror(rc);
-        log_fatal("%s", err);
-        exit(rc);
+        if ((rc = mdb_dbi_open(txn, dbs[i].name, dbs[i].flags | MDB_CREATE,
+                        dbs[i].dbi)))
+        {
+            err = mdb_strerror(rc);
+            log_fatal("%s", err);
+            exit(rc);
+        }
     }
-    flags = MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED;
-    if ((rc = mdb_dbi_open(txn, "payments", flags, &db_payments)))
+    mdb_set_compare(txn, db_shares, compare_uint64);
+    mdb_set_dupsort(txn, db_shares, compare_share_rec);
+    mdb_set_compare(txn, db_rollups, compare_rollup_key);
+    mdb_set_compare(txn, db_blocks, compare_uint64);
+    mdb_set_dupsort(txn, db_blocks, compare_block);
+    mdb_set_compare(txn, db_locked, compare_uint64);
+    mdb_set_dupsort(txn, db_payments, compare_payment_rec);
+
+    MDB_val k, v;
+    k.mv_data = "upstream_last_height";
+    k.mv_size = strlen(k.mv_data);
+    if (!mdb_get(txn, db_properties, &k, &v))
+        memcpy(&upstream_last_height, v.mv_data, v.mv_size);
+    k.mv_data = "upstream_last_time";
+    k.mv_size = strlen(k.mv_data);
+    if (!mdb_get(txn, db_properties, &k, &v))
+        memcpy(&upstream_last_time, v.mv_data, v.mv_size);
+    k.mv_data = "accounts_saved";
+    k.mv_size = strlen(k.mv_data);
+    if (!mdb_get(txn, db_properties, &k, &v))
     {
-        err = mdb_strerror(rc);
-        log_fatal("%s", err);
-        exit(rc);
+        int64_t saved;
+        memcpy(&saved, v.mv_data, sizeof(saved));
+        accounts_saved = saved;
     }
-    flags = MDB_CREATE;
-    if ((rc = mdb_dbi_open(txn, "balance", flags, &db_balance)))
+    uint32_t version = 1;
+    k.mv_data = "schema_version";
+    k.mv_size = strlen(k.mv_data);
+    if (!mdb_get(txn, db_properties, &k, &v))
+        memcpy(&version, v.mv_data, sizeof(version));
+    if (version < SCHEMA_VERSION && (rc = database_upgrade(txn, version)))
     {
         err = mdb_strerror(rc);
-        log_fatal("%s", err);
+        log_fatal("Cannot upgrade database: %s", err);
         exit(rc);
     }
-    if ((rc = mdb_dbi_open(txn, "properties", flags, &db_properties)))
+    if (config.pool_fee_wallet[0] && (rc = address_id_get(txn,
+                    config.pool_fee_wallet, true, &fee_address_id)))
     {
         err = mdb_strerror(rc);
-        log_fatal("%s", err);
+        log_fatal("Cannot store pool fee wallet: %s", err);
         exit(rc);
     }
-    MDB_val k, v;
-    k.mv_data = "upstream_last_height";
-    k.mv_size = strlen(k.mv_data);
-    if (!mdb_get(txn, db_properties, &k, &v))
-        memcpy(&upstream_last_height, v.mv_data, v.mv_size);
-    k.mv_data = "upstream_last_time";
-    k.mv_size = strlen(k.mv_data);
-    if (!mdb_get(txn, db_properties, &k, &v))
-        memcpy(&upstream_last_time, v.mv_data, v.mv_size);
-
-    mdb_set_compare(txn, db_shares, compare_uint64);
-    mdb_set_dupsort(txn, db_shares, compare_share);
-    mdb_set_compare(txn, db_blocks, compare_uint64);
-    mdb_set_dupsort(txn, db_blocks, compare_block);
-    mdb_set_compare(txn, db_payments, compare_string);
-    mdb_set_dupsort(txn, db_payments, compare_payment);
-    mdb_set_compare(txn, db_balance, compare_string);
 
     rc = mdb_txn_commit(txn);
     return rc;
@@ -639,48 +1263,233 @@ database_close(void)
 {
     log_info("Closing database");
     mdb_dbi_close(env, db_shares);
+    mdb_dbi_close(env, db_rollups);
     mdb_dbi_close(env, db_blocks);
+    mdb_dbi_close(env, db_locked);
     mdb_dbi_close(env, db_balance);
     mdb_dbi_close(env, db_payments);
     mdb_dbi_close(env, db_properties);
+    mdb_dbi_close(env, db_addresses);
+    mdb_dbi_close(env, db_address_ids);
+    mdb_dbi_close(env, db_account_stats);
+    if (shares_v1)
+        mdb_dbi_close(env, db_shares_v1);
     mdb_env_close(env);
 }
 
+static inline uint64_t
+monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static int
-store_share(uint64_t height, share_t *share)
+rollup_add(MDB_txn *txn, const share_rec_t *share)
 {
+    int rc = 0;
+    rollup_key_t rk = {share->height, share->address_id, share->difficulty};
+    rollup_t r = {0, share->timestamp, share->timestamp};
+    MDB_val k = {sizeof(rk), (void*)&rk};
+    MDB_val v;
+    if (!(rc = mdb_get(txn, db_rollups, &k, &v)))
+    {
+        const rollup_t *cr = (const rollup_t*) v.mv_data;
+        r.difficulty = cr->difficulty;
+        r.first = MIN(r.first, cr->first);
+        r.last = MAX(r.last, cr->last);
+    }
+    else if (rc != MDB_NOTFOUND)
+        return rc;
+    r.difficulty += share->difficulty;
+    v.mv_size = sizeof(r);
+    v.mv_data = &r;
+    return mdb_put(txn, db_rollups, &k, &v, 0);
+}
+
+static rollup_entry_t *
+rollup_push(rollup_buf_t *rb)
+{
+    if (rb->count == rb->max)
+    {
+        rb->max = rb->max ? rb->max << 1 : SHARE_BUFFER_INIT;
+        rb->entries = realloc(rb->entries,
+                rb->max * sizeof(rollup_entry_t));
+    }
+    return &rb->entries[rb->count++];
+}
+
+static int
+compare_entry_key(const void *a, const void *b)
+{
+    const rollup_entry_t *ea = (const rollup_entry_t*) a;
+    const rollup_entry_t *eb = (const rollup_entry_t*) b;
+    if (ea->address_id != eb->address_id)
+        return ea->address_id < eb->address_id ? -1 : 1;
+    return ea->share_difficulty < eb->share_difficulty ? -1
+        : ea->share_difficulty > eb->share_difficulty;
+}
+
+static int
+flush_shares(void)
+{
+    /*
+      Commits everything buffered by store_share in a single txn. The
+      buffer is swapped out first so other threads can keep storing shares
+      whilst the txn is written. Should the txn fail, the batch is put back
+      in front of anything stored since, to be retried on the next flush.
+    */
     int rc = 0;
     char *err = NULL;
     MDB_txn *txn = NULL;
     MDB_cursor *cursor = NULL;
+    share_rec_t *shares = NULL;
+    size_t count = 0;
+    size_t max = 0;
+    uint64_t since = 0;
+
+    pthread_mutex_lock(&mutex_share_commit);
+    pthread_mutex_lock(&mutex_shares);
+    shares = share_buffer;
+    count = share_buffer_count;
+    since = share_buffer_since;
+    share_buffer = share_spare;
+    share_spare = shares;
+    max = share_buffer_max;
+    share_buffer_max = share_spare_max;
+    share_spare_max = max;
+    share_buffer_count = 0;
+    share_buffer_held = 0;
+    pthread_mutex_unlock(&mutex_shares);
+
+    if (!count)
+        goto unlock;
+
     if ((rc = pdb_txn_begin(env, NULL, 0, &txn)))
     {
         err = mdb_strerror(rc);
         log_error("%s", err);
-        return rc;
+        goto requeue;
     }
     if ((rc = mdb_cursor_open(txn, db_shares, &cursor)))
     {
         err = mdb_strerror(rc);
         log_error("%s", err);
         mdb_txn_abort(txn);
-        return rc;
+        goto requeue;
     }
 
-    MDB_val key = { sizeof(height), (void*)&height };
-    MDB_val val = { sizeof(share_t), (void*)share };
-    if ((rc = mdb_cursor_put(cursor, &key, &val, MDB_APPENDDUP)))
+    for (size_t i=0; i<count; i++)
     {
-        err = mdb_strerror(rc);
-        log_error("%s", err);
-        mdb_txn_abort(txn);
-        return rc;
+        share_rec_t *share = &shares[i];
+        MDB_val key = { sizeof(share->height), (void*)&share->height };
+        MDB_val val = { sizeof(share_rec_t), (void*)share };
+        rc = mdb_cursor_put(cursor, &key, &val, MDB_APPENDDUP);
+        if (rc == MDB_KEYEXIST)
+            rc = mdb_cursor_put(cursor, &key, &val, MDB_NODUPDATA);
+        if (rc == MDB_KEYEXIST)
+        {
+            log_warn("Share already stored at height: %"PRIu64,
+                    share->height);
+            rc = 0;
+            continue;
+        }
+        if (!rc)
+            rc = rollup_add(txn, share);
+        if (rc)
+        {
+            err = mdb_strerror(rc);
+            log_error("%s", err);
+            mdb_txn_abort(txn);
+            goto requeue;
+        }
     }
 
-    rc = mdb_txn_commit(txn);
+    if ((rc = mdb_txn_commit(txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        goto requeue;
+    }
+    pool_metrics.share_commits++;
+    pool_metrics.shares_committed += count;
+    pool_metrics.share_commit_size = count;
+    pool_metrics.share_commit_latency = monotonic_us() - since;
+    log_trace("Committed %zu shares in %"PRIu64"us", count,
+            pool_metrics.share_commit_latency);
+    goto unlock;
+
+requeue:
+    pthread_mutex_lock(&mutex_shares);
+    if (share_buffer_count + count > share_buffer_max)
+    {
+        share_buffer_max = share_buffer_count + count;
+        share_buffer = realloc(share_buffer,
+                share_buffer_max * sizeof(share_rec_t));
+    }
+    memmove(&share_buffer[count], share_buffer,
+            share_buffer_count * sizeof(share_rec_t));
+    memcpy(share_buffer, shares, count * sizeof(share_rec_t));
+    share_buffer_count += count;
+    share_buffer_held += count;
+    share_buffer_since = since;
+    pthread_mutex_unlock(&mutex_shares);
+    log_warn("Will retry committing %zu shares", count);
+unlock:
+    pthread_mutex_unlock(&mutex_share_commit);
     return rc;
 }
 
+static int
+store_share(const share_rec_t *share)
+{
+    /*
+      Shares are buffered and committed as a group once either
+      share-commit-batch shares have built up or the oldest has waited
+      share-commit-latency ms (see timer_on_shares).
+    */
+    bool full = false;
+    pthread_mutex_lock(&mutex_shares);
+    if (share_buffer_count == share_buffer_max)
+    {
+        share_buffer_max = share_buffer_max ?
+            share_buffer_max << 1 : SHARE_BUFFER_INIT;
+        share_buffer = realloc(share_buffer,
+                share_buffer_max * sizeof(share_rec_t));
+    }
+    if (!share_buffer_count)
+        share_buffer_since = monotonic_us();
+    share_buffer[share_buffer_count++] = *share;
+    /* Shares held back by a failed commit don't count towards a batch */
+    full = share_buffer_count - share_buffer_held >= config.share_commit_batch
+        || !config.share_commit_latency;
+    pthread_mutex_unlock(&mutex_shares);
+    if (full)
+        return flush_shares();
+    return 0;
+}
+
+static int
+locked_put(MDB_txn *txn, const block_t *block)
+{
+    int rc = 0;
+    MDB_val key = { sizeof(block->height), (void*)&block->height };
+    MDB_val val = { sizeof(block->hash), (void*)block->hash };
+    rc = mdb_put(txn, db_locked, &key, &val, MDB_NODUPDATA);
+    return rc == MDB_KEYEXIST ? 0 : rc;
+}
+
+static int
+locked_del(MDB_txn *txn, const block_t *block)
+{
+    int rc = 0;
+    MDB_val key = { sizeof(block->height), (void*)&block->height };
+    MDB_val val = { sizeof(block->hash), (void*)block->hash };
+    rc = mdb_del(txn, db_locked, &key, &val);
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
 static int
 store_block(uint64_t height, block_t *block)
 {
@@ -711,17 +1520,280 @@ store_block(uint64_t height, block_t *block)
         mdb_txn_abort(txn);
         return rc;
     }
+    if (block->status == BLOCK_LOCKED && (rc = locked_put(txn, block)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        mdb_txn_abort(txn);
+        return rc;
+    }
 
     rc = mdb_txn_commit(txn);
     return rc;
 }
 
+/*
+  Connected accounts are interned once, at login, to a small integer id.
+  Accounts live in a dense array indexed by id, and clients keep a pointer
+  to theirs, so only a login or a web UI lookup ever hashes an address.
+  The address index is open addressed (linear probing, backward shift
+  deletion) and holds only a hash and an id per slot. All of it is guarded
+  by rwlock_acc.
+*/
+
+static uint32_t
+address_hash(const char *address)
+{
+    uint32_t h = 2166136261u;
+    while (*address)
+    {
+        h ^= (unsigned char)*address++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static account_t *
+account_find(const char *address)
+{
+    if (!account_index_used)
+        return NULL;
+    uint32_t mask = account_index_size - 1;
+    uint32_t h = address_hash(address);
+    for (uint32_t i = h & mask; account_index[i].id; i = (i+1) & mask)
+    {
+        account_t *account = accounts[account_index[i].id - 1];
+        if (account_index[i].hash == h
+                && !strncmp(account->address, address, ADDRESS_MAX))
+            return account;
+    }
+    return NULL;
+}
+
+static void
+account_index_put(uint32_t hash, uint32_t id)
+{
+    uint32_t mask = account_index_size - 1;
+    uint32_t i = hash & mask;
+    while (account_index[i].id)
+        i = (i+1) & mask;
+    account_index[i].hash = hash;
+    account_index[i].id = id + 1;
+}
+
+static void
+account_index_grow(void)
+{
+    account_slot_t *old = account_index;
+    uint32_t old_size = account_index_size;
+    account_index_size = old_size ? old_size << 1 : CLIENTS_INIT;
+    account_index = calloc(account_index_size, sizeof(account_slot_t));
+    for (uint32_t i=0; i<old_size; i++)
+        if (old[i].id)
+            account_index_put(old[i].hash, old[i].id - 1);
+    free(old);
+}
+
+static void
+account_index_del(uint32_t id)
+{
+    uint32_t mask = account_index_size - 1;
+    account_t *account = accounts[id];
+    uint32_t i = account->hash & mask;
+    while (account_index[i].id != id + 1)
+        i = (i+1) & mask;
+    for (uint32_t j = i;;)
+    {
+        account_index[i].id = 0;
+        for (;;)
+        {
+            j = (j+1) & mask;
+            if (!account_index[j].id)
+                return;
+            /* Stays put if its home slot lies cyclically in (i, j] */
+            uint32_t k = account_index[j].hash & mask;
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            break;
+        }
+        account_index[i] = account_index[j];
+        i = j;
+    }
+}
+
+static account_t *
+account_intern(const char *address, bool *created)
+{
+    account_t *account = account_find(address);
+    *created = !account;
+    if (account)
+        return account;
+
+    uint32_t id;
+    if (account_ids_free_count)
+        id = account_ids_free[--account_ids_free_count];
+    else
+    {
+        if (accounts_next == accounts_max)
+        {
+            accounts_max = accounts_max ? accounts_max << 1 : CLIENTS_INIT;
+            accounts = realloc(accounts, accounts_max * sizeof(account_t*));
+            account_ids_free = realloc(account_ids_free,
+                    accounts_max * sizeof(uint32_t));
+        }
+        id = accounts_next++;
+    }
+    if ((account_index_used + 1) * 2 > account_index_size)
+        account_index_grow();
+
+    account = calloc(1, sizeof(account_t));
+    account->id = id;
+    account->hash = address_hash(address);
+    strncpy(account->address, address, sizeof(account->address)-1);
+    accounts[id] = account;
+    account_index_put(account->hash, id);
+    account_index_used++;
+    return account;
+}
+
+static void
+account_release(account_t *account)
+{
+    uint32_t id = account->id;
+    account_index_del(id);
+    account_index_used--;
+    accounts[id] = NULL;
+    account_ids_free[account_ids_free_count++] = id;
+    free(account);
+}
+
+static void
+accounts_free(void)
+{
+    for (uint32_t i=0; i<accounts_next; i++)
+        free(accounts[i]);
+    free(accounts);
+    free(account_ids_free);
+    free(account_index);
+    accounts = NULL;
+    account_ids_free = NULL;
+    account_index = NULL;
+    accounts_max = accounts_next = account_ids_free_count = 0;
+    account_index_size = account_index_used = 0;
+}
+
+static int
+accounts_checkpoint(void)
+{
+    /*
+      Saves each connected account's hashes and hashrate averages, so a
+      restart carries on from them. With more than one process, each saves
+      the accounts it serves.
+    */
+    int rc = 0;
+    char *err = NULL;
+    MDB_txn *txn = NULL;
+    MDB_val k, v;
+    uint32_t count = 0;
+    uint32_t *ids = NULL;
+    account_stats_t *stats = NULL;
+    int64_t now = time(NULL);
+
+    pthread_rwlock_rdlock(&rwlock_acc);
+    if (account_index_used)
+    {
+        ids = malloc(account_index_used * sizeof(uint32_t));
+        stats = malloc(account_index_used * sizeof(account_stats_t));
+    }
+    for (uint32_t i=0; i<accounts_next && ids; i++)
+    {
+        const account_t *account = accounts[i];
+        if (!account || !account->address_id)
+            continue;
+        ids[count] = account->address_id;
+        stats[count].saved = now;
+        stats[count].hashes = account->hashes;
+        stats[count].hr_stats = account->hr_stats;
+        count++;
+    }
+    pthread_rwlock_unlock(&rwlock_acc);
+    if (!count)
+        goto done;
+
+    if ((rc = pdb_txn_begin(env, NULL, 0, &txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        goto done;
+    }
+    for (uint32_t i=0; i<count; i++)
+    {
+        k.mv_size = sizeof(uint32_t);
+        k.mv_data = &ids[i];
+        v.mv_size = sizeof(account_stats_t);
+        v.mv_data = &stats[i];
+        if ((rc = mdb_put(txn, db_account_stats, &k, &v, 0)))
+            break;
+    }
+    if (!rc)
+    {
+        k.mv_data = "accounts_saved";
+        k.mv_size = strlen(k.mv_data);
+        v.mv_data = &now;
+        v.mv_size = sizeof(now);
+        rc = mdb_put(txn, db_properties, &k, &v, 0);
+    }
+    if (rc)
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        mdb_txn_abort(txn);
+        goto done;
+    }
+    if ((rc = mdb_txn_commit(txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+    }
+done:
+    free(ids);
+    free(stats);
+    return rc;
+}
+
+static int
+account_stats_get(uint32_t address_id, account_stats_t *stats)
+{
+    /*
+      Only stats saved by the run before this one are handed back, and only
+      for accounts still connected at its last checkpoint. Otherwise an
+      account starts afresh, as it always has on reconnecting.
+    */
+    int rc = 0;
+    MDB_txn *txn = NULL;
+    MDB_val k = { sizeof(address_id), (void*)&address_id };
+    MDB_val v;
+    if (!accounts_saved)
+        return MDB_NOTFOUND;
+    if ((rc = pdb_txn_begin(env, NULL, MDB_RDONLY, &txn)))
+        return rc;
+    if (!(rc = mdb_get(txn, db_account_stats, &k, &v)))
+    {
+        memcpy(stats, v.mv_data, sizeof(account_stats_t));
+        if (stats->saved > accounts_saved
+                || stats->saved + CHECKPOINT_INTERVAL < accounts_saved)
+            rc = MDB_NOTFOUND;
+    }
+    mdb_txn_abort(txn);
+    return rc;
+}
+
 void
 account_hr(double *avg, const char *address)
 {
     account_t *account = NULL;
     pthread_rwlock_rdlock(&rwlock_acc);
-    HASH_FIND_STR(accounts, address, account);
+    account = account_find(address);
     if (!account)
         goto bail;
     memcpy(avg, account->hr_stats.avg, sizeof(account->hr_stats.avg));
@@ -737,6 +1809,7 @@ account_balance(const char *address)
     MDB_txn *txn = NULL;
     MDB_cursor *cursor = NULL;
     uint64_t balance  = 0;
+    uint32_t id = 0;
 
     if (strlen(address) > ADDRESS_MAX)
         return balance;
@@ -747,17 +1820,19 @@ account_balance(const char *address)
     {
         err = mdb_strerror(rc);
         log_error("%s", err);
+        txn = NULL;
         goto cleanup;
     }
+    if ((rc = address_id_get(txn, address, false, &id)))
+        goto cleanup;
     if ((rc = mdb_cursor_open(txn, db_balance, &cursor)))
     {
         err = mdb_strerror(rc);
         log_error("%s", err);
-        mdb_txn_abort(txn);
         goto cleanup;
     }
 
-    MDB_val key = {ADDRESS_MAX, (void*)address};
+    MDB_val key = {sizeof(id), (void*)&id};
     MDB_val val;
 
     if ((rc = mdb_cursor_get(cursor, &key, &val, MDB_SET)))
@@ -787,7 +1862,7 @@ worker_count(const char *address)
     account_t *account = NULL;
     uint64_t wc = 0;
     pthread_rwlock_rdlock(&rwlock_acc);
-    HASH_FIND_STR(accounts, address, account);
+    account = account_find(address);
     if (!account)
         goto bail;
     wc = (uint64_t)account->worker_count;
@@ -806,14 +1881,17 @@ worker_list(char *list_start, char *list_end, const char *address)
     if (strlen(address) > ADDRESS_MAX)
         return;
     pthread_rwlock_rdlock(&rwlock_acc);
-    HASH_FIND_STR(accounts, address, account);
+    account = account_find(address);
     if (!account)
         goto bail;
 
-    client_t *c = (client_t*)gbag_first(bag_clients);
-    while ((c = gbag_next(bag_clients, 0)) && body < (end-MAX_RIG_ID-24))
+    void *it = NULL;
+    client_t *c = NULL;
+    pthread_mutex_lock(&mutex_clients);
+    while ((c = gbag_next_r(bag_clients, &it))
+            && body < (end-MAX_RIG_ID-24))
     {
-        if (!strncmp(c->address, address, ADDRESS_MAX))
+        if (c->account == account)
         {
             if (body != list_start)
                 *body++ = ',';
@@ -821,149 +1899,478 @@ worker_list(char *list_start, char *list_end, const char *address)
                     c->rig_id, (uint64_t)(c->hr_stats.avg[1]));
         }
     }
+    pthread_mutex_unlock(&mutex_clients);
 bail:
     pthread_rwlock_unlock(&rwlock_acc);
 }
 
-static int
-balance_add(const char *address, uint64_t amount, MDB_txn *parent)
+static void
+payout_credit(payout_sums_t *ps, uint32_t address_id, uint64_t amount)
 {
-    log_trace("Adding %"PRIu64" to %s's balance", amount, address);
-    int rc = 0;
-    char *err = NULL;
-    MDB_txn *txn = NULL;
-    MDB_cursor *cursor = NULL;
-    if ((rc = pdb_txn_begin(env, parent, 0, &txn)))
-    {
-        err = mdb_strerror(rc);
-        log_error("%s", err);
-        return rc;
-    }
-    if ((rc = mdb_cursor_open(txn, db_balance, &cursor)))
-    {
-        err = mdb_strerror(rc);
-        log_error("%s", err);
-        mdb_txn_abort(txn);
-        return rc;
-    }
-
-    MDB_val key = {ADDRESS_MAX, (void*)address};
-    MDB_val val;
-    rc = mdb_cursor_get(cursor, &key, &val, MDB_SET);
-    if (rc == MDB_NOTFOUND)
+    if (address_id >= ps->max)
     {
-        log_trace("Adding new balance entry");
-        MDB_val new_val = { sizeof(amount), (void*)&amount };
-        if ((rc = mdb_cursor_put(cursor, &key, &new_val, 0)))
-        {
-            err = mdb_strerror(rc);
-            log_error("%s", err);
-        }
+        uint32_t max = ps->max ? ps->max : CLIENTS_INIT;
+        while (max <= address_id)
+            max <<= 1;
+        ps->amounts = realloc(ps->amounts, max * sizeof(uint64_t));
+        memset(ps->amounts + ps->max, 0,
+                (max - ps->max) * sizeof(uint64_t));
+        ps->max = max;
     }
-    else if (rc == 0)
+    if (!ps->amounts[address_id])
     {
-        log_trace("Updating existing balance entry");
-        uint64_t current_amount = *(uint64_t*)val.mv_data;
-        current_amount += amount;
-        MDB_val new_val = {sizeof(current_amount), (void*)&current_amount};
-        if ((rc = mdb_cursor_put(cursor, &key, &new_val, MDB_CURRENT)))
+        if (ps->count == ps->ids_max)
         {
-            err = mdb_strerror(rc);
-            log_error("%s", err);
+            ps->ids_max = ps->ids_max ? ps->ids_max << 1 : CLIENTS_INIT;
+            ps->ids = realloc(ps->ids, ps->ids_max * sizeof(uint32_t));
         }
+        ps->ids[ps->count++] = address_id;
     }
-    else
-    {
-        err = mdb_strerror(rc);
-        log_error("%s", err);
-        mdb_txn_abort(txn);
-        return rc;
-    }
+    ps->amounts[address_id] += amount;
+}
 
-    rc = mdb_txn_commit(txn);
-    return rc;
+static int
+compare_address_id(const void *a, const void *b)
+{
+    uint32_t ia = *(const uint32_t*)a;
+    uint32_t ib = *(const uint32_t*)b;
+    return ia < ib ? -1 : ia > ib;
 }
 
 static int
-payout_block(block_t *block, MDB_txn *parent)
+balances_add(payout_sums_t *ps, MDB_txn *txn)
 {
     /*
-      PPLNS
+      Applies every credit from a payout through one cursor, in id order so
+      consecutive updates land on neighbouring pages.
     */
-    log_info("Payout on block at height: %"PRIu64, block->height);
     int rc = 0;
     char *err = NULL;
-    MDB_txn *txn = NULL;
     MDB_cursor *cursor = NULL;
-    uint64_t height = block->height;
-    uint64_t total_paid = 0;
-    if ((rc = pdb_txn_begin(env, parent, 0, &txn)))
-    {
-        err = mdb_strerror(rc);
-        log_error("%s", err);
-        return rc;
-    }
-    if ((rc = mdb_cursor_open(txn, db_shares, &cursor)))
+    if ((rc = mdb_cursor_open(txn, db_balance, &cursor)))
     {
         err = mdb_strerror(rc);
         log_error("%s", err);
-        mdb_txn_abort(txn);
         return rc;
     }
-
-    MDB_cursor_op op = MDB_SET;
-    while (1)
+    qsort(ps->ids, ps->count, sizeof(uint32_t), compare_address_id);
+    for (uint32_t i=0; i<ps->count; i++)
     {
-        uint64_t current_height = height;
-        MDB_val key = { sizeof(current_height), (void*)&current_height };
+        uint32_t id = ps->ids[i];
+        uint64_t amount = ps->amounts[id];
+        log_trace("Adding %"PRIu64" to %"PRIu32"'s balance", amount, id);
+        MDB_val key = {sizeof(id), (void*)&id};
         MDB_val val;
-        rc = mdb_cursor_get(cursor, &key, &val, op);
-        op = MDB_NEXT_DUP;
-        if (rc == MDB_NOTFOUND && total_paid < block->reward)
+        unsigned flags = 0;
+        rc = mdb_cursor_get(cursor, &key, &val, MDB_SET);
+        if (rc == 0)
         {
-            if (height == 0)
-                break;
-            height--;
-            op = MDB_SET;
-            continue;
+            amount += *(uint64_t*)val.mv_data;
+            flags = MDB_CURRENT;
         }
-        if (rc && rc != MDB_NOTFOUND)
-        {
-            log_error("Error getting share: %s", mdb_strerror(rc));
+        else if (rc != MDB_NOTFOUND)
             break;
-        }
-        if (total_paid == block->reward)
+        MDB_val new_val = {sizeof(amount), (void*)&amount};
+        if ((rc = mdb_cursor_put(cursor, &key, &new_val, flags)))
             break;
-
-        share_t *share = (share_t*)val.mv_data;
-        uint64_t amount = floor((double)share->difficulty /
-            ((double)block->difficulty * config.share_mul) * block->reward);
-        if (total_paid + amount > block->reward)
-            amount = block->reward - total_paid;
-        total_paid += amount;
-        uint64_t fee = amount * config.pool_fee;
-        amount -= fee;
-        if (fee > 0 && config.pool_fee_wallet[0])
-        {
-            if ((rc = balance_add(config.pool_fee_wallet, fee, txn)))
-            {
-                err = mdb_strerror(rc);
-                log_error("Error adding pool fee balance: %s", err);
+    }
+    if (rc)
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+    }
+    mdb_cursor_close(cursor);
+    return rc;
+}
+
+static int
+share_from_v1(MDB_txn *txn, const share_t *share, share_rec_t *rec)
+{
+    rec->height = share->height;
+    rec->difficulty = share->difficulty;
+    rec->timestamp = (uint32_t) share->timestamp;
+    return address_id_get(txn, share->address, true, &rec->address_id);
+}
+
+static int
+height_prev(MDB_cursor *cursor, MDB_val *at, uint64_t *height)
+{
+    /* Share and rollup keys both lead with the height */
+    int rc = 0;
+    MDB_val k = *at, v;
+    if ((rc = mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE)) == MDB_NOTFOUND)
+        rc = mdb_cursor_get(cursor, &k, &v, MDB_LAST);
+    else if (!rc)
+        rc = mdb_cursor_get(cursor, &k, &v, MDB_PREV);
+    if (!rc)
+        memcpy(height, k.mv_data, sizeof(uint64_t));
+    return rc;
+}
+
+static int
+height_rollups(MDB_cursor *cursor, uint64_t height, rollup_buf_t *rb)
+{
+    int rc = 0;
+    rollup_key_t rk = {height, 0, 0};
+    MDB_val k = {sizeof(rk), (void*)&rk};
+    MDB_val v;
+    MDB_cursor_op op = MDB_SET_RANGE;
+    rb->count = 0;
+    while (!(rc = mdb_cursor_get(cursor, &k, &v, op)))
+    {
+        op = MDB_NEXT;
+        const rollup_key_t *ck = (const rollup_key_t*) k.mv_data;
+        const rollup_t *r = (const rollup_t*) v.mv_data;
+        if (ck->height != height)
+            break;
+        rollup_entry_t *e = rollup_push(rb);
+        e->difficulty = r->difficulty;
+        e->share_difficulty = ck->share_difficulty;
+        e->address_id = ck->address_id;
+        e->first = r->first;
+        e->last = r->last;
+    }
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+static int
+height_shares(MDB_txn *txn, MDB_cursor *cursor, MDB_cursor *cursor_v1,
+        uint64_t height, rollup_buf_t *rb)
+{
+    /*
+      Sums the raw shares at a height per address and share difficulty,
+      giving exactly what its rollups hold (or will, once built). Resolving
+      version 1 addresses needs a write txn.
+    */
+    int rc = 0;
+    rb->count = rb->rows = 0;
+    for (int i=0; i<2; i++)
+    {
+        MDB_cursor *cur = i ? cursor : cursor_v1;
+        if (!cur)
+            continue;
+        MDB_val k = {sizeof(height), (void*)&height};
+        MDB_val v;
+        MDB_cursor_op op = MDB_SET;
+        while (!(rc = mdb_cursor_get(cur, &k, &v, op)))
+        {
+            op = MDB_NEXT_DUP;
+            share_rec_t sr;
+            if (cur == cursor)
+                memcpy(&sr, v.mv_data, sizeof(share_rec_t));
+            else if ((rc = share_from_v1(txn, (share_t*)v.mv_data, &sr)))
+            {
+                if (rc == EINVAL)
+                    continue;
+                return rc;
             }
+            rollup_entry_t *e = rollup_push(rb);
+            e->difficulty = e->share_difficulty = sr.difficulty;
+            e->address_id = sr.address_id;
+            e->first = e->last = sr.timestamp;
+            rb->rows++;
         }
-        if (amount == 0)
+        if (rc != MDB_NOTFOUND)
+            return rc;
+    }
+    qsort(rb->entries, rb->count, sizeof(rollup_entry_t), compare_entry_key);
+    size_t n = 0;
+    for (size_t i=0; i<rb->count; i++)
+    {
+        rollup_entry_t *e = &rb->entries[i];
+        rollup_entry_t *m = n ? &rb->entries[n-1] : NULL;
+        if (m && !compare_entry_key(m, e))
+        {
+            m->difficulty += e->difficulty;
+            m->first = MIN(m->first, e->first);
+            m->last = MAX(m->last, e->last);
+        }
+        else
+            rb->entries[n++] = *e;
+    }
+    rb->count = n;
+    return 0;
+}
+
+static inline uint64_t
+share_reward(const block_t *block, uint64_t difficulty)
+{
+    return floor((double)difficulty /
+        ((double)block->difficulty * config.share_mul) * block->reward);
+}
+
+static void
+payout_share(payout_run_t *pr, uint32_t address_id, uint64_t difficulty)
+{
+    const block_t *block = pr->block;
+    uint64_t amount = share_reward(block, difficulty);
+    if (pr->paid + amount > block->reward)
+        amount = block->reward - pr->paid;
+    pr->paid += amount;
+    uint64_t fee = amount * config.pool_fee;
+    amount -= fee;
+    if (fee > 0 && fee_address_id)
+        pr->fee += fee;
+    if (amount == 0)
+        return;
+    payout_credit(&pr->sums, address_id, amount);
+}
+
+static int
+payout_height_shares(MDB_txn *txn, MDB_cursor *cursor,
+        MDB_cursor *cursor_v1, uint64_t height, payout_run_t *pr)
+{
+    /*
+      Pays a height a share at a time, in the order stored. Version 1 rows
+      not yet migrated are older than any version 2 rows at the same
+      height, so are paid first.
+    */
+    int rc = 0;
+    for (int i=0; i<2; i++)
+    {
+        MDB_cursor *cur = i ? cursor : cursor_v1;
+        if (!cur)
             continue;
-        if ((rc = balance_add(share->address, amount, txn)))
+        MDB_val k = {sizeof(height), (void*)&height};
+        MDB_val v;
+        MDB_cursor_op op = MDB_SET;
+        while (pr->paid < pr->block->reward
+                && !(rc = mdb_cursor_get(cur, &k, &v, op)))
         {
-            err = mdb_strerror(rc);
-            log_error("%s", err);
-            mdb_cursor_close(cursor);
-            mdb_txn_abort(txn);
+            op = MDB_NEXT_DUP;
+            share_rec_t sr;
+            if (cur == cursor)
+                memcpy(&sr, v.mv_data, sizeof(share_rec_t));
+            else if ((rc = share_from_v1(txn, (share_t*)v.mv_data, &sr)))
+                return rc;
+            pr->rows++;
+            payout_share(pr, sr.address_id, sr.difficulty);
+        }
+        if (rc && rc != MDB_NOTFOUND)
             return rc;
+    }
+    return 0;
+}
+
+static bool
+payout_height_rollups(const rollup_buf_t *rb, payout_run_t *pr)
+{
+    /*
+      Pays a whole height from its rollups. All the shares in a rollup have
+      the same difficulty, so the same floored amount and fee, making this
+      the same as paying each in turn, provided the reward isn't used up
+      part way through the height. If it would be, nothing is paid.
+    */
+    const block_t *block = pr->block;
+    uint64_t total = 0;
+    for (size_t i=0; i<rb->count; i++)
+    {
+        const rollup_entry_t *e = &rb->entries[i];
+        if (e->share_difficulty)
+            total += e->difficulty / e->share_difficulty
+                * share_reward(block, e->share_difficulty);
+    }
+    if (pr->paid + total > block->reward)
+        return false;
+    for (size_t i=0; i<rb->count; i++)
+    {
+        const rollup_entry_t *e = &rb->entries[i];
+        if (!e->share_difficulty)
+            continue;
+        uint64_t count = e->difficulty / e->share_difficulty;
+        uint64_t amount = share_reward(block, e->share_difficulty);
+        uint64_t fee = amount * config.pool_fee;
+        pr->paid += count * amount;
+        if (fee > 0 && fee_address_id)
+            pr->fee += count * fee;
+        if (amount - fee)
+            payout_credit(&pr->sums, e->address_id, count * (amount - fee));
+    }
+    return true;
+}
+
+#ifdef PAYOUT_CHECK
+static void
+payout_check(MDB_txn *txn, MDB_cursor *cursor, MDB_cursor *cursor_v1,
+        const payout_run_t *pr)
+{
+    /*
+      Pays the block again the original way, a share at a time down every
+      height, and complains if that differs from what the rollups gave.
+    */
+    int rc = 0;
+    payout_run_t check = { .block = pr->block };
+    const payout_sums_t *ps = &pr->sums;
+    uint64_t height = pr->block->height;
+    bool same = true;
+    while (check.paid < check.block->reward)
+    {
+        uint64_t prev = 0, h = 0;
+        bool found = false;
+        if ((rc = payout_height_shares(txn, cursor, cursor_v1, height,
+                        &check)))
+            goto error;
+        MDB_val at = {sizeof(height), (void*)&height};
+        MDB_cursor *curs[] = {cursor, cursor_v1};
+        for (int i=0; i<2; i++)
+        {
+            if (!curs[i])
+                continue;
+            if (!(rc = height_prev(curs[i], &at, &h)))
+            {
+                prev = found ? MAX(prev, h) : h;
+                found = true;
+            }
+            else if (rc != MDB_NOTFOUND)
+                goto error;
         }
+        if (!found)
+            break;
+        height = prev;
     }
+    same = check.paid == pr->paid && check.fee == pr->fee
+        && check.sums.count == ps->count;
+    for (uint32_t i=0; i<check.sums.count && same; i++)
+    {
+        uint32_t id = check.sums.ids[i];
+        same = id < ps->max && ps->amounts[id] == check.sums.amounts[id];
+    }
+    if (same)
+        log_debug("Payout matches share by share payout");
+    else
+        log_error("Payout differs from share by share payout: "
+                "%"PRIu64"/%"PRIu64" paid, %"PRIu64"/%"PRIu64" fee",
+                pr->paid, check.paid, pr->fee, check.fee);
+    goto cleanup;
 
-    rc = mdb_txn_commit(txn);
+error:
+    log_error("Cannot check payout: %s", mdb_strerror(rc));
+cleanup:
+    free(check.sums.amounts);
+    free(check.sums.ids);
+}
+#endif
+
+static int
+payout_block(block_t *block, MDB_txn *parent)
+{
+    /*
+      PPLNS
+
+      The window is walked a height at a time, newest first. A height that
+      fits in what is left of the reward is paid from its rollups (or, if
+      still awaiting migration, the same sums taken from its raw shares).
+      The height where the reward runs out is paid share by share, so the
+      split is exactly as if every share had been walked.
+    */
+    log_info("Payout on block at height: %"PRIu64, block->height);
+    int rc = 0;
+    char *err = NULL;
+    MDB_txn *txn = NULL;
+    MDB_cursor *cursor = NULL;
+    MDB_cursor *cursor_v1 = NULL;
+    MDB_cursor *cursor_r = NULL;
+    uint64_t height = block->height;
+    uint64_t start = monotonic_us();
+    payout_run_t pr = { .block = block };
+    rollup_buf_t rb = {0};
+    if ((rc = pdb_txn_begin(env, parent, 0, &txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        return rc;
+    }
+    if ((rc = mdb_cursor_open(txn, db_rollups, &cursor_r))
+            || (rc = mdb_cursor_open(txn, db_shares, &cursor))
+            || (shares_v1
+                && (rc = mdb_cursor_open(txn, db_shares_v1, &cursor_v1))))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        goto abort;
+    }
+
+    while (pr.paid < block->reward)
+    {
+        if (migrating && height < migrate_floor)
+            rc = height_shares(txn, cursor, cursor_v1, height, &rb);
+        else
+            rc = height_rollups(cursor_r, height, &rb);
+        if (!rc)
+        {
+            pr.rows += rb.count;
+            if (!payout_height_rollups(&rb, &pr))
+                rc = payout_height_shares(txn, cursor, cursor_v1, height,
+                        &pr);
+        }
+        if (rc)
+        {
+            log_error("Error getting shares: %s", mdb_strerror(rc));
+            goto abort;
+        }
+        if (pr.paid >= block->reward)
+            break;
+
+        /* Next height down that has any shares */
+        uint64_t prev = 0, h = 0;
+        bool found = false;
+        rollup_key_t rk = {height, 0, 0};
+        MDB_val at = {sizeof(rk), (void*)&rk};
+        MDB_val ath = {sizeof(height), (void*)&height};
+        MDB_cursor *curs[] = {cursor_r, cursor, cursor_v1};
+        for (int i=0; i<3; i++)
+        {
+            if (!curs[i] || (i && !migrating))
+                continue;
+            if (!(rc = height_prev(curs[i], i ? &ath : &at, &h)))
+            {
+                prev = found ? MAX(prev, h) : h;
+                found = true;
+            }
+            else if (rc != MDB_NOTFOUND)
+            {
+                log_error("Error getting shares: %s", mdb_strerror(rc));
+                goto abort;
+            }
+        }
+        if (!found)
+            break;
+        height = prev;
+    }
+
+#ifdef PAYOUT_CHECK
+    payout_check(txn, cursor, cursor_v1, &pr);
+#endif
+    if (pr.fee)
+        payout_credit(&pr.sums, fee_address_id, pr.fee);
+    if ((rc = balances_add(&pr.sums, txn)))
+        goto abort;
+    if ((rc = mdb_txn_commit(txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        goto cleanup;
+    }
+    pool_metrics.payouts++;
+    pool_metrics.payout_rows = pr.rows;
+    pool_metrics.payout_addresses = pr.sums.count;
+    pool_metrics.payout_time = monotonic_us() - start;
+    log_info("Paid %"PRIu64" rows to %"PRIu32" addresses in %"PRIu64"us",
+            pr.rows, pr.sums.count, pool_metrics.payout_time);
+    goto cleanup;
+
+abort:
+    if (cursor_v1)
+        mdb_cursor_close(cursor_v1);
+    if (cursor)
+        mdb_cursor_close(cursor);
+    if (cursor_r)
+        mdb_cursor_close(cursor_r);
+    mdb_txn_abort(txn);
+cleanup:
+    free(pr.sums.amounts);
+    free(pr.sums.ids);
+    free(rb.entries);
     return rc;
 }
 
@@ -974,6 +2381,7 @@ process_blocks(block_t *blocks, size_t count)
         return 0;
 
     log_debug("Processing blocks");
+    flush_shares();
     /*
       For each block, lookup block in db.
       If found, make sure found is locked and not orphaned.
@@ -1035,6 +2443,7 @@ process_blocks(block_t *blocks, size_t count)
                 nb.status |= BLOCK_ORPHANED;
                 MDB_val new_val = {sizeof(block_t), (void*)&nb};
                 mdb_cursor_put(cursor, &key, &new_val, MDB_CURRENT);
+                locked_del(txn, &nb);
                 continue;
             }
             if (memcmp(ib->prev_hash, sb->prev_hash, 64))
@@ -1045,6 +2454,7 @@ process_blocks(block_t *blocks, size_t count)
                 nb.status |= BLOCK_ORPHANED;
                 MDB_val new_val = {sizeof(block_t), (void*)&nb};
                 mdb_cursor_put(cursor, &key, &new_val, MDB_CURRENT);
+                locked_del(txn, &nb);
                 continue;
             }
             if (ib->status & BLOCK_ORPHANED)
@@ -1053,6 +2463,7 @@ process_blocks(block_t *blocks, size_t count)
                 nb.status |= BLOCK_ORPHANED;
                 MDB_val new_val = {sizeof(block_t), (void*)&nb};
                 mdb_cursor_put(cursor, &key, &new_val, MDB_CURRENT);
+                locked_del(txn, &nb);
                 continue;
             }
             nb.status |= BLOCK_UNLOCKED;
@@ -1064,6 +2475,7 @@ process_blocks(block_t *blocks, size_t count)
                 log_debug("Paid out block: %"PRIu64, nb.height);
                 MDB_val new_val = {sizeof(block_t), (void*)&nb};
                 mdb_cursor_put(cursor, &key, &new_val, MDB_CURRENT);
+                locked_del(txn, &nb);
             }
             else
                 log_trace("%s", mdb_strerror(rc));
@@ -1078,43 +2490,221 @@ static void
 update_pool_hr(void)
 {
     uint64_t hr = 0;
-    client_t *c = (client_t*)gbag_first(bag_clients);
-    while ((c = gbag_next(bag_clients, 0)))
+    void *it = NULL;
+    client_t *c = NULL;
+    pthread_mutex_lock(&mutex_clients);
+    while ((c = gbag_next_r(bag_clients, &it)))
         hr += (uint64_t) c->hr_stats.avg[0];
+    pthread_mutex_unlock(&mutex_clients);
     log_debug("Pool hashrate: %"PRIu64, hr);
     if (upstream_event)
         return;
     pool_stats.pool_hashrate = hr;
 }
 
+/*
+  Job messages are rendered once per template with markers where the per
+  client values go (see MARK_*), which are then split out into slots. A job
+  send only writes the constant text and slot values straight into the
+  output buffer, no formatting involved.
+*/
+static char *
+job_body_render(const char *format, ...)
+{
+    va_list args, copy;
+    va_start(args, format);
+    va_copy(copy, args);
+    int size = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    char *marked = NULL;
+    if (size >= 0 && (marked = malloc(size + 1)))
+        vsnprintf(marked, size + 1, format, args);
+    va_end(args);
+    return marked;
+}
+
 static void
-job_recycle(void *item)
+job_body_build(job_body_t *jb, char *marked)
 {
-    job_t *job = (job_t*) item;
-    log_trace("Recycle job with extra_nonce: %u", job->extra_nonce);
-    if (job->blob)
+    const char *p = marked;
+    char *t = marked;
+    jb->cuts = 0;
+    while (*p)
     {
-        free(job->blob);
-        job->blob = NULL;
+        if (*p == SLOT_MARK && p[1] && jb->cuts < JOB_BODY_CUTS)
+        {
+            jb->cut[jb->cuts] = t - marked;
+            jb->slot[jb->cuts++] = p[1] - '0';
+            p += 2;
+            continue;
+        }
+        *t++ = *p++;
     }
-    if (job->submissions)
+    *t = 0;
+    jb->text = marked;
+    jb->size = t - marked;
+}
+
+static void
+job_body_free(job_body_t *jb)
+{
+    free(jb->text);
+    memset(jb, 0, sizeof(job_body_t));
+}
+
+static void
+job_body_send(const job_body_t *jb, const job_slots_t *js,
+        struct evbuffer *output)
+{
+    struct evbuffer_iovec v;
+    size_t size = jb->size;
+    size_t off = 0;
+    char *p = NULL;
+
+    for (unsigned i=0; i<jb->cuts; i++)
+        size += js->size[jb->slot[i]];
+    if (evbuffer_reserve_space(output, size, &v, 1) < 1)
     {
-        free(job->submissions);
-        job->submissions = NULL;
+        log_error("Cannot reserve space for job");
+        return;
     }
-    if (job->miner_template)
+    p = (char*) v.iov_base;
+    for (unsigned i=0; i<jb->cuts; i++)
     {
-        block_template_t *bt = job->miner_template;
-        if (bt->block_blob)
-        {
-            free(bt->block_blob);
-            bt->block_blob = NULL;
-            bt->block_blob_size = 0;
-        }
-        free(job->miner_template);
-        job->miner_template = NULL;
+        uint8_t slot = jb->slot[i];
+        memcpy(p, jb->text + off, jb->cut[i] - off);
+        p += jb->cut[i] - off;
+        off = jb->cut[i];
+        memcpy(p, js->value[slot], js->size[slot]);
+        p += js->size[slot];
     }
-    memset(job, 0, sizeof(job_t));
+    memcpy(p, jb->text + off, jb->size - off);
+    log_trace("Miner job: %.*s", (int)size-1, (char*)v.iov_base);
+    v.iov_len = size;
+    evbuffer_commit_space(output, &v, 1);
+}
+
+static size_t
+u64_to_dec(uint64_t u, char *out)
+{
+    char tmp[20];
+    size_t n = 0, i = 0;
+    do
+    {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    }
+    while (u);
+    while (n)
+        out[i++] = tmp[--n];
+    return i;
+}
+
+static void
+template_build_bodies(block_template_t *bt)
+{
+    job_body_t *jb = bt->job_bodies;
+    char *marked = NULL;
+
+    marked = job_body_render("{\"jsonrpc\":\"2.0\",\"method\":"
+            "\"job\",\"params\""
+            ":{\"id\":\"" MARK_CLIENT_ID "\",\"blob\":\"" MARK_BLOB "\","
+            "\"job_id\":\"" MARK_JOB_ID "\","
+            "\"target\":\"" MARK_TARGET "\","
+            "\"height\":%"PRIu64",\"seed_hash\":\"%.64s\","
+            "\"next_seed_hash\":\"%.64s\"}}\n",
+            bt->height, bt->seed_hash, bt->next_seed_hash);
+    if (marked)
+        job_body_build(&jb[JOB_BODY_NOTIFY], marked);
+
+    marked = job_body_render("{\"id\":" MARK_JSON_ID ",\"jsonrpc\":\"2.0\","
+            "\"error\":null,\"result\""
+            ":{\"id\":\"" MARK_CLIENT_ID "\",\"job\":{"
+            "\"blob\":\"" MARK_BLOB "\",\"job_id\":\"" MARK_JOB_ID "\","
+            "\"target\":\"" MARK_TARGET "\","
+            "\"height\":%"PRIu64",\"seed_hash\":\"%.64s\","
+            "\"next_seed_hash\":\"%.64s\"},"
+            "\"status\":\"OK\"}}\n",
+            bt->height, bt->seed_hash, bt->next_seed_hash);
+    if (marked)
+        job_body_build(&jb[JOB_BODY_RESPONSE], marked);
+
+    /* A proxy gets the whole block with our reserved bytes patched in */
+    int hex_size = (int) strlen(bt->block_hex);
+    int ro = bt->reserved_offset << 1;
+    if (ro + 16 > hex_size)
+    {
+        log_warn("Reserved offset out of range; cannot send proxy jobs");
+        return;
+    }
+
+    marked = job_body_render("{\"jsonrpc\":\"2.0\",\"method\":"
+            "\"job\",\"params\""
+            ":{\"id\":\"" MARK_CLIENT_ID "\",\"job\":{"
+            "\"blocktemplate_blob\":\"%.*s" MARK_RESERVED "%s\","
+            "\"job_id\":\"" MARK_JOB_ID "\","
+            "\"difficulty\":%"PRIu64",\"height\":%"PRIu64","
+            "\"reserved_offset\":%u,"
+            "\"client_nonce_offset\":%u,\"client_pool_offset\":%u,"
+            "\"target_diff\":" MARK_TARGET_DIFF ","
+            "\"target_diff_hex\":\"" MARK_TARGET "\","
+            "\"seed_hash\":\"%.64s\",\"next_seed_hash\":\"%.64s\"},"
+            "\"status\":\"OK\"}}\n",
+            ro, bt->block_hex, bt->block_hex + ro + 16,
+            bt->difficulty, bt->height,
+            bt->reserved_offset, bt->reserved_offset + 12,
+            bt->reserved_offset + 8, bt->seed_hash, bt->next_seed_hash);
+    if (marked)
+        job_body_build(&jb[JOB_BODY_PROXY_NOTIFY], marked);
+
+    marked = job_body_render("{\"id\":" MARK_JSON_ID ",\"jsonrpc\":\"2.0\","
+            "\"error\":null,\"result\""
+            ":{\"id\":\"" MARK_CLIENT_ID "\",\"job\":{"
+            "\"blocktemplate_blob\":\"%.*s" MARK_RESERVED "%s\","
+            "\"job_id\":\"" MARK_JOB_ID "\","
+            "\"difficulty\":%"PRIu64",\"height\":%"PRIu64","
+            "\"reserved_offset\":%u,"
+            "\"client_nonce_offset\":%u,\"client_pool_offset\":%u,"
+            "\"target_diff\":" MARK_TARGET_DIFF ","
+            "\"target_diff_hex\":\"" MARK_TARGET "\","
+            "\"seed_hash\":\"%.64s\",\"next_seed_hash\":\"%.64s\"},"
+            "\"status\":\"OK\"}}\n",
+            ro, bt->block_hex, bt->block_hex + ro + 16,
+            bt->difficulty, bt->height,
+            bt->reserved_offset, bt->reserved_offset + 12,
+            bt->reserved_offset + 8, bt->seed_hash, bt->next_seed_hash);
+    if (marked)
+        job_body_build(&jb[JOB_BODY_PROXY_RESPONSE], marked);
+}
+
+static void
+job_bodies_ss_init(void)
+{
+    /* Self-select jobs carry no template data, so are the same throughout */
+    char *marked = NULL;
+
+    marked = job_body_render("{\"jsonrpc\":\"2.0\",\"method\":"
+            "\"job\",\"params\""
+            ":{\"id\":\"" MARK_CLIENT_ID "\","
+            "\"job_id\":\"" MARK_JOB_ID "\","
+            "\"target\":\"" MARK_TARGET "\","
+            "\"extra_nonce\":\"" MARK_EXTRA_NONCE "\", \"pool_wallet\":\"%s\","
+            "\"seed_hash\":\"\",\"next_seed_hash\":\"\"}}\n",
+            config.pool_wallet);
+    if (marked)
+        job_body_build(&job_bodies_ss[JOB_BODY_NOTIFY], marked);
+
+    marked = job_body_render("{\"id\":" MARK_JSON_ID ",\"jsonrpc\":\"2.0\","
+            "\"error\":null,\"result\""
+            ":{\"id\":\"" MARK_CLIENT_ID "\",\"job\":{"
+            "\"job_id\":\"" MARK_JOB_ID "\","
+            "\"target\":\"" MARK_TARGET "\","
+            "\"extra_nonce\":\"" MARK_EXTRA_NONCE "\", \"pool_wallet\":\"%s\","
+            "\"seed_hash\":\"\",\"next_seed_hash\":\"\"},"
+            "\"status\":\"OK\"}}\n",
+            config.pool_wallet);
+    if (marked)
+        job_body_build(&job_bodies_ss[JOB_BODY_RESPONSE], marked);
 }
 
 static void
@@ -1122,6 +2712,11 @@ template_recycle(void *item)
 {
     block_template_t *bt = (block_template_t*) item;
     log_trace("Recycle block template at height: %"PRIu64, bt->height);
+    if (bt->hashing_template)
+    {
+        free_hashing_template(bt->hashing_template);
+        bt->hashing_template = NULL;
+    }
     if (bt->hashing_blob)
     {
         free(bt->hashing_blob);
@@ -1134,6 +2729,28 @@ template_recycle(void *item)
         bt->block_blob = NULL;
         bt->block_blob_size = 0;
     }
+    if (bt->block_hex)
+    {
+        free(bt->block_hex);
+        bt->block_hex = NULL;
+    }
+    for (unsigned i=0; i<JOB_BODY_MAX; i++)
+        job_body_free(&bt->job_bodies[i]);
+}
+
+static void
+job_recycle(void *item)
+{
+    job_t *job = (job_t*) item;
+    log_trace("Recycle job with extra_nonce: %u", job->extra_nonce);
+    dupset_clear(&job->submissions);
+    if (job->miner_template)
+    {
+        template_recycle(job->miner_template);
+        free(job->miner_template);
+        job->miner_template = NULL;
+    }
+    memset(job, 0, sizeof(job_t));
 }
 
 static uint64_t
@@ -1177,203 +2794,90 @@ retarget(client_t *client, job_t *job)
 {
     uint64_t target = client_target(client, job);
     job->target = target;
+    if (target != client->target || !*client->target_hex)
+    {
+        target_to_hex(target, client->target_hex);
+        client->target = target;
+    }
+    memcpy(job->target_hex, client->target_hex, sizeof(job->target_hex));
     log_debug("Miner %.32s target now: %"PRIu64, client->client_id, target);
 }
 
-static void
-target_to_hex(uint64_t target, char *target_hex)
+static inline void
+stratum_get_error_body(char *body, int json_id, const char *error)
 {
-    if (target & 0xFFFFFFFF00000000)
-    {
-        log_debug("High target requested: %"PRIu64, target);
-        bin_to_hex((const unsigned char*)&target, 8, &target_hex[0]);
-        return;
-    }
-    BIGNUM *diff = BN_new();
-    BIGNUM *bnt = BN_new();
-#ifdef SIXTY_FOUR_BIT_LONG
-    BN_set_word(bnt, target);
-#else
-    char tmp[24] = {0};
-    snprintf(tmp, 24, "%"PRIu64, target);
-    BN_dec2bn(&bnt, tmp);
-#endif
-    BN_div(diff, NULL, base_diff, bnt, bn_ctx);
-    BN_rshift(diff, diff, 224);
-    uint32_t w = BN_get_word(diff);
-    bin_to_hex((const unsigned char*)&w, 4, &target_hex[0]);
-    BN_free(bnt);
-    BN_free(diff);
+    snprintf(body, ERROR_BODY_MAX, "{\"id\":%d,\"jsonrpc\":\"2.0\","
+            "\"error\":"
+            "{\"code\":-1, \"message\":\"%s\"}}\n", json_id, error);
 }
 
-static void
-stratum_get_proxy_job_body(char *body, const client_t *client,
-        const char *block_hex, bool response)
-{
-    int json_id = client->json_id;
-    const char *client_id = client->client_id;
-    const job_t *job = bstack_top(client->active_jobs);
-    char job_id[33] = {0};
-    bin_to_hex((const unsigned char*)job->id, sizeof(uuid_t), job_id);
-    uint64_t target = job->target;
-    char target_hex[17] = {0};
-    target_to_hex(target, &target_hex[0]);
-    const block_template_t *bt = job->block_template;
-
-    if (response)
-    {
-        snprintf(body, JOB_BODY_MAX, "{\"id\":%d,\"jsonrpc\":\"2.0\","
-                "\"error\":null,\"result\""
-                ":{\"id\":\"%.32s\",\"job\":{\"blocktemplate_blob\":\"%s\","
-                "\"job_id\":\"%.32s\","
-                "\"difficulty\":%"PRIu64",\"height\":%"PRIu64","
-                "\"reserved_offset\":%u,"
-                "\"client_nonce_offset\":%u,\"client_pool_offset\":%u,"
-                "\"target_diff\":%"PRIu64",\"target_diff_hex\":\"%s\","
-                "\"seed_hash\":\"%.64s\",\"next_seed_hash\":\"%.64s\"},"
-                "\"status\":\"OK\"}}\n",
-                json_id, client_id, block_hex, job_id,
-                bt->difficulty, bt->height, bt->reserved_offset,
-                bt->reserved_offset + 12,
-                bt->reserved_offset + 8, target, target_hex,
-                bt->seed_hash, bt->next_seed_hash);
-    }
-    else
-    {
-        snprintf(body, JOB_BODY_MAX, "{\"jsonrpc\":\"2.0\",\"method\":"
-                "\"job\",\"params\""
-                ":{\"id\":\"%.32s\",\"job\":{\"blocktemplate_blob\":\"%s\","
-                "\"job_id\":\"%.32s\","
-                "\"difficulty\":%"PRIu64",\"height\":%"PRIu64","
-                "\"reserved_offset\":%u,"
-                "\"client_nonce_offset\":%u,\"client_pool_offset\":%u,"
-                "\"target_diff\":%"PRIu64",\"target_diff_hex\":\"%s\","
-                "\"seed_hash\":\"%.64s\",\"next_seed_hash\":\"%.64s\"},"
-                "\"status\":\"OK\"}}\n", client_id, block_hex, job_id,
-                bt->difficulty, bt->height,
-                bt->reserved_offset, bt->reserved_offset + 12,
-                bt->reserved_offset + 8, target, target_hex,
-                bt->seed_hash, bt->next_seed_hash);
-    }
+static inline void
+stratum_get_status_body(char *body, int json_id, const char *status)
+{
+    snprintf(body, STATUS_BODY_MAX, "{\"id\":%d,\"jsonrpc\":\"2.0\","
+            "\"error\":null,\"result\":{\"status\":\"%s\"}}\n",
+            json_id, status);
+}
+
+static submission_t *
+submission_new(void)
+{
+    slab_stats_t st;
+    submission_t *s = slab_get(reactor->slab_submissions);
+    slab_stats(reactor->slab_submissions, &st);
+    pool_metrics.submission_allocs = st.gets;
+    pool_metrics.submission_heap_allocs = st.heap_allocs;
+    return s;
 }
 
 static void
-stratum_get_job_body_ss(char *body, const client_t *client, bool response)
-{
-    /* job_id, target, pool_wallet, extra_nonce */
-    int json_id = client->json_id;
-    const char *client_id = client->client_id;
-    const job_t *job = bstack_top(client->active_jobs);
-    char job_id[33] = {0};
-    bin_to_hex((const unsigned char*)job->id, sizeof(uuid_t), job_id);
-    uint64_t target = job->target;
-    char target_hex[17] = {0};
-    target_to_hex(target, &target_hex[0]);
-    char empty[] = "";
-    char *seed_hash = empty;
-    char *next_seed_hash = empty;
-    if (job->miner_template)
-    {
-        seed_hash = job->miner_template->seed_hash;
-        next_seed_hash = job->miner_template->next_seed_hash;
-    }
-    unsigned char extra_bin[8] = {0};
-    memcpy(extra_bin, &job->extra_nonce, 4);
-    memcpy(extra_bin+4, &instance_id, 4);
-    char extra_hex[17] = {0};
-    bin_to_hex(extra_bin, 8, extra_hex);
-
-    if (response)
-    {
-        snprintf(body, JOB_BODY_MAX, "{\"id\":%d,\"jsonrpc\":\"2.0\","
-                "\"error\":null,\"result\""
-                ":{\"id\":\"%.32s\",\"job\":{"
-                "\"job_id\":\"%.32s\",\"target\":\"%s\","
-                "\"extra_nonce\":\"%s\", \"pool_wallet\":\"%s\","
-                "\"seed_hash\":\"%.64s\",\"next_seed_hash\":\"%.64s\"},"
-                "\"status\":\"OK\"}}\n",
-                json_id, client_id, job_id, target_hex, extra_hex,
-                config.pool_wallet, seed_hash, next_seed_hash);
-    }
+client_push_submission(client_t *client, submission_t *s)
+{
+    if (client->pending_tail)
+        client->pending_tail->next = s;
     else
-    {
-        snprintf(body, JOB_BODY_MAX, "{\"jsonrpc\":\"2.0\",\"method\":"
-                "\"job\",\"params\""
-                ":{\"id\":\"%.32s\",\"job_id\":\"%.32s\","
-                "\"target\":\"%s\","
-                "\"extra_nonce\":\"%s\", \"pool_wallet\":\"%s\","
-                "\"seed_hash\":\"%.64s\",\"next_seed_hash\":\"%.64s\"}}\n",
-                client_id, job_id, target_hex, extra_hex, config.pool_wallet,
-                seed_hash, next_seed_hash);
-    }
+        client->pending = s;
+    client->pending_tail = s;
+    client->pending_count++;
 }
 
 static void
-stratum_get_job_body(char *body, const client_t *client, bool response)
-{
-    int json_id = client->json_id;
-    const char *client_id = client->client_id;
-    const job_t *job = bstack_top(client->active_jobs);
-    char job_id[33] = {0};
-    bin_to_hex((const unsigned char*)job->id, sizeof(uuid_t), job_id);
-    const char *blob = job->blob;
-    uint64_t target = job->target;
-    uint64_t height = job->block_template->height;
-    char target_hex[17] = {0};
-    target_to_hex(target, &target_hex[0]);
-    char *seed_hash = job->block_template->seed_hash;
-    char *next_seed_hash = job->block_template->next_seed_hash;
-
-    if (response)
-    {
-        snprintf(body, JOB_BODY_MAX, "{\"id\":%d,\"jsonrpc\":\"2.0\","
-                "\"error\":null,\"result\""
-                ":{\"id\":\"%.32s\",\"job\":{"
-                "\"blob\":\"%s\",\"job_id\":\"%.32s\",\"target\":\"%s\","
-                "\"height\":%"PRIu64",\"seed_hash\":\"%.64s\","
-                "\"next_seed_hash\":\"%.64s\"},"
-                "\"status\":\"OK\"}}\n",
-                json_id, client_id, blob, job_id, target_hex, height,
-                seed_hash, next_seed_hash);
-    }
-    else
-    {
-        snprintf(body, JOB_BODY_MAX, "{\"jsonrpc\":\"2.0\",\"method\":"
-                "\"job\",\"params\""
-                ":{\"id\":\"%.32s\",\"blob\":\"%s\",\"job_id\":\"%.32s\","
-                "\"target\":\"%s\","
-                "\"height\":%"PRIu64",\"seed_hash\":\"%.64s\","
-                "\"next_seed_hash\":\"%.64s\"}}\n",
-                client_id, blob, job_id, target_hex, height,
-                seed_hash, next_seed_hash);
-    }
-}
-
-static inline void
-stratum_get_error_body(char *body, int json_id, const char *error)
+send_error(client_t *client, const char *message)
 {
-    snprintf(body, ERROR_BODY_MAX, "{\"id\":%d,\"jsonrpc\":\"2.0\","
-            "\"error\":"
-            "{\"code\":-1, \"message\":\"%s\"}}\n", json_id, error);
+    /* Keep replies in order behind any shares still being verified */
+    if (client->pending)
+    {
+        submission_t *s = submission_new();
+        s->json_id = client->json_id;
+        s->error = message;
+        s->done = true;
+        client_push_submission(client, s);
+        return;
+    }
+    struct evbuffer *output = bufferevent_get_output(client->bev);
+    char body[ERROR_BODY_MAX] = {0};
+    stratum_get_error_body(body, client->json_id, message);
+    evbuffer_add(output, body, strlen(body));
 }
 
-static inline void
-stratum_get_status_body(char *body, int json_id, const char *status)
+static void
+send_validation_error(client_t *client, const char *message)
 {
-    snprintf(body, STATUS_BODY_MAX, "{\"id\":%d,\"jsonrpc\":\"2.0\","
-            "\"error\":null,\"result\":{\"status\":\"%s\"}}\n",
-            json_id, status);
+    send_error(client, message);
+    log_debug("[%s:%d] Validation error: %s",
+            client->host, client->port, message);
 }
 
 static void
-send_validation_error(const client_t *client, const char *message)
+submission_free(submission_t *s)
 {
-    struct evbuffer *output = bufferevent_get_output(client->bev);
-    char body[ERROR_BODY_MAX] = {0};
-    stratum_get_error_body(body, client->json_id, message);
-    evbuffer_add(output, body, strlen(body));
-    log_debug("[%s:%d] Validation error: %s",
-            client->host, client->port, message);
+    free(s->block);
+    if (s->miner_template)
+    {
+        template_recycle(s->miner_template);
+        free(s->miner_template);
+    }
+    slab_put(reactor->slab_submissions, s);
 }
 
 static void
@@ -1385,125 +2889,193 @@ client_clear_jobs(client_t *client)
     client->active_jobs = NULL;
 }
 
+static void
+job_set_id(client_t *client, job_t *job)
+{
+    /*
+      A job id is: push sequence|client serial|instance_id, so a submitted
+      id points straight at its slot in the client's active jobs.
+    */
+    uint64_t seq = bstack_pushed(client->active_jobs) - 1;
+    uint32_t serial = (uint32_t) client->serial;
+    memcpy(job->id, &seq, sizeof(seq));
+    memcpy(job->id+8, &serial, sizeof(serial));
+    memcpy(job->id+12, &instance_id, sizeof(instance_id));
+}
+
 static job_t *
 client_find_job(client_t *client, const char *job_id)
 {
-    uuid_t jid;
+    unsigned char jid[JOB_ID_SIZE];
+    uint64_t seq;
     job_t *job = NULL;
-    hex_to_bin(job_id, (unsigned char*)&jid, sizeof(uuid_t));
-    bstack_reset(client->active_jobs);
-    while ((job = bstack_next(client->active_jobs)))
-    {
-        if (memcmp(job->id, jid, sizeof(uuid_t)) == 0)
-            break;
-    }
-    return job;
+    hex_to_bin(job_id, jid, JOB_ID_SIZE);
+    memcpy(&seq, jid, sizeof(seq));
+    job = bstack_get(client->active_jobs, seq);
+    if (job && memcmp(job->id, jid, JOB_ID_SIZE) == 0)
+        return job;
+    return NULL;
 }
 
-static void
-miner_send_job(client_t *client, bool response)
+static block_template_t *
+template_current(void)
+{
+    block_template_t *bt = NULL;
+    pthread_rwlock_rdlock(&rwlock_tpl);
+    bt = bstack_top(bst);
+    pthread_rwlock_unlock(&rwlock_tpl);
+    return bt;
+}
+
+static job_t *
+job_prepare(client_t *client, job_send_t *send, bool response)
 {
+    /*
+      Everything a job needs from the client is settled here, so the rest
+      (see job_build) can run away from the event loop.
+    */
     job_t *job = bstack_push(client->active_jobs, NULL);
-    block_template_t *bt = bstack_top(bst);
+    block_template_t *bt = template_current();
+    uint32_t en = __atomic_add_fetch(&extra_nonce, 1, __ATOMIC_RELAXED);
     job->block_template = bt;
+    job->extra_nonce = en;
+    job_set_id(client, job);
+    retarget(client, job);
 
-    if (client->mode == MODE_SELF_SELECT)
-    {
-        uuid_generate(job->id);
-        retarget(client, job);
-        ++extra_nonce;
-        job->extra_nonce = extra_nonce;
-        char body[JOB_BODY_MAX] = {0};
-        stratum_get_job_body_ss(body, client, response);
-        log_trace("Miner job: %s", body);
-        struct evbuffer *output = bufferevent_get_output(client->bev);
-        evbuffer_add(output, body, strlen(body));
-        return;
-    }
+    send->fd = client->fd;
+    send->serial = client->serial;
+    send->seq = bstack_pushed(client->active_jobs) - 1;
+    send->json_id = client->json_id;
+    send->response = response;
+    send->is_xnp = client->is_xnp;
+    send->self_select = client->mode == MODE_SELF_SELECT;
+    memcpy(send->client_id, client->client_id, sizeof(client->client_id));
+    send->client_id[sizeof(client->client_id)] = 0;
+    memcpy(send->job_id, job->id, JOB_ID_SIZE);
+    send->target = job->target;
+    memcpy(send->target_hex, job->target_hex, sizeof(send->target_hex));
+    memcpy(send->reserved, &en, sizeof(en));
+    memcpy(send->reserved+4, &instance_id, sizeof(instance_id));
+    send->block_template = bt;
+    send->hashing_blob_size = 0;
+    send->body = NULL;
+    return job;
+}
 
-    /* Quick check we actually have a block template */
-    if (!bt)
+static void
+job_build(job_send_t *send, struct evbuffer *output)
+{
+    block_template_t *bt = send->block_template;
+    const job_body_t *jb = NULL;
+    job_slots_t js;
+    char json_id[12];
+    char job_id[JOB_ID_SIZE<<1];
+    char extra_hex[sizeof(send->reserved)<<1];
+    char blob[HASHING_BLOB_MAX<<1];
+    char target_diff[20];
+    size_t n = 0;
+
+    memset(&js, 0, sizeof(js));
+    if (send->self_select)
     {
-        log_warn("Cannot send client a job: No block template");
-        return;
+        bin_to_hex(send->reserved, sizeof(send->reserved), extra_hex);
+        js.value[SLOT_EXTRA_NONCE] = extra_hex;
+        js.size[SLOT_EXTRA_NONCE] = sizeof(extra_hex);
+        jb = &job_bodies_ss[send->response];
+        goto send;
     }
 
     /*
-      1. Copy block_template->block_blob
-      2. Update bytes in reserved space at reserved_offset
-      3. Get block hashing blob for job
-      4. Send
-    */
+      1. Get block hashing blob for job (from the template's cached hashing
+         template, only parsing a patched copy of the block if unavailable)
+      2. Send (patching the template's pre-rendered job body)
 
-    /* Copy */
-    unsigned char *block = calloc(bt->block_blob_size, sizeof(char));
-    memcpy(block, bt->block_blob, bt->block_blob_size);
-
-    /* Set the extra nonce in our reserved space */
-    unsigned char *p = block;
-    p += bt->reserved_offset;
-    ++extra_nonce;
-    memcpy(p, &extra_nonce, sizeof(extra_nonce));
-    job->extra_nonce = extra_nonce;
-
-    /* Add our instance ID */
-    p += 4;
-    memcpy(p, &instance_id, sizeof(instance_id));
-
-    /* Get hashing blob */
+      Note reserved space is: extra_nonce|instance_id
+    */
+    unsigned char *hashing_blob = send->hashing_blob;
     size_t hashing_blob_size = 0;
-    unsigned char *hashing_blob = NULL;
-    get_hashing_blob(block, bt->block_blob_size, &hashing_blob,
-            &hashing_blob_size);
-
-    /* Make hex */
-    job->blob = calloc((hashing_blob_size << 1) +1, sizeof(char));
-    bin_to_hex(hashing_blob, hashing_blob_size, job->blob);
-    log_trace("Miner hashing blob: %s", job->blob);
-
-    /* Save a job id */
-    uuid_generate(job->id);
-
-    /* Send */
-    char job_id[33] = {0};
-    bin_to_hex((const unsigned char*)job->id, sizeof(uuid_t), &job_id[0]);
-
-    /* Retarget */
-    retarget(client, job);
+    bool parse = !bt->hashing_template
+        || get_job_hashing_blob(bt->hashing_template, bt->reserved_offset,
+                send->reserved, sizeof(send->reserved),
+                hashing_blob, &hashing_blob_size);
+
+    if (parse)
+    {
+        unsigned char *hb = NULL;
+        unsigned char *block = calloc(bt->block_blob_size, sizeof(char));
+        memcpy(block, bt->block_blob, bt->block_blob_size);
+        memcpy(block + bt->reserved_offset, send->reserved,
+                sizeof(send->reserved));
+        get_hashing_blob(block, bt->block_blob_size, &hb,
+                &hashing_blob_size);
+        hashing_blob_size = MIN(hashing_blob_size, HASHING_BLOB_MAX);
+        memcpy(hashing_blob, hb, hashing_blob_size);
+        free(hb);
+        free(block);
+    }
+    send->hashing_blob_size = hashing_blob_size;
 
-    char body[JOB_BODY_MAX] = {0};
-    if (!client->is_xnp)
+    if (!send->is_xnp)
     {
-        stratum_get_job_body(body, client, response);
+        bin_to_hex(hashing_blob, hashing_blob_size, blob);
+        log_trace("Miner hashing blob: %.*s",
+                (int)hashing_blob_size<<1, blob);
+        js.value[SLOT_BLOB] = blob;
+        js.size[SLOT_BLOB] = hashing_blob_size<<1;
+        jb = &bt->job_bodies[JOB_BODY_NOTIFY + send->response];
     }
     else
     {
-        size_t hex_size = bt->block_blob_size<<1;
-        char *block_hex = calloc(hex_size+1, sizeof(char));
-        bin_to_hex(block, bt->block_blob_size, block_hex);
-        stratum_get_proxy_job_body(body, client, block_hex, response);
-        free(block_hex);
+        bin_to_hex(send->reserved, sizeof(send->reserved), extra_hex);
+        js.value[SLOT_RESERVED] = extra_hex;
+        js.size[SLOT_RESERVED] = sizeof(extra_hex);
+        js.value[SLOT_TARGET_DIFF] = target_diff;
+        js.size[SLOT_TARGET_DIFF] = u64_to_dec(send->target, target_diff);
+        jb = &bt->job_bodies[JOB_BODY_PROXY_NOTIFY + send->response];
     }
-    log_trace("Miner job: %.*s", strlen(body)-1, body);
-    struct evbuffer *output = bufferevent_get_output(client->bev);
-    evbuffer_add(output, body, strlen(body));
-    free(block);
-    free(hashing_blob);
+
+send:
+    if (!jb->text)
+    {
+        log_warn("Cannot send client a job: No job body");
+        return;
+    }
+    if (send->json_id < 0)
+    {
+        json_id[n++] = '-';
+        n += u64_to_dec(-(int64_t)send->json_id, json_id+1);
+    }
+    else
+        n = u64_to_dec(send->json_id, json_id);
+    bin_to_hex(send->job_id, JOB_ID_SIZE, job_id);
+
+    js.value[SLOT_JSON_ID] = json_id;
+    js.size[SLOT_JSON_ID] = n;
+    js.value[SLOT_CLIENT_ID] = send->client_id;
+    js.size[SLOT_CLIENT_ID] = strnlen(send->client_id, 32);
+    js.value[SLOT_JOB_ID] = job_id;
+    js.size[SLOT_JOB_ID] = sizeof(job_id);
+    js.value[SLOT_TARGET] = send->target_hex;
+    js.size[SLOT_TARGET] = strlen(send->target_hex);
+    job_body_send(jb, &js, output);
 }
 
 static void
-accounts_moved(const void *items, size_t count)
+miner_send_job(client_t *client, bool response)
 {
-    account_t *s, *e, *r;
-    s = (account_t*) items;
-    e = s + count;
-    pthread_rwlock_wrlock(&rwlock_acc);
-    while (s<e)
+    job_send_t send;
+    job_t *job = job_prepare(client, &send, response);
+
+    /* Quick check we actually have a block template */
+    if (!send.self_select && !job->block_template)
     {
-        HASH_REPLACE_STR(accounts, address, s, r);
-        s++;
+        log_warn("Cannot send client a job: No block template");
+        return;
     }
-    pthread_rwlock_unlock(&rwlock_acc);
+
+    job_build(&send, bufferevent_get_output(client->bev));
+    job->hashing_blob_size = send.hashing_blob_size;
+    memcpy(job->hashing_blob, send.hashing_blob, send.hashing_blob_size);
 }
 
 static void
@@ -1521,32 +3093,180 @@ clients_moved(const void *items, size_t count)
     pthread_rwlock_unlock(&rwlock_cfd);
 }
 
+static void
+broadcast_finish(void)
+{
+    uint64_t took = monotonic_us() - reactor->broadcast_start;
+    pool_metrics.broadcast_time = took;
+    if (took > pool_metrics.broadcast_time_max)
+        pool_metrics.broadcast_time_max = took;
+    log_debug("Job broadcast to %"PRIu64" clients took %"PRIu64"us",
+            pool_metrics.broadcast_clients, took);
+}
+
+static void
+broadcast_build(void *item)
+{
+    /* Runs on a broadcast thread, so only touches the job send itself */
+    job_send_t *send = (job_send_t*) item;
+    send->body = evbuffer_new();
+    job_build(send, send->body);
+}
+
+static void
+broadcast_on_built(void *item)
+{
+    job_send_t *send = (job_send_t*) item;
+    client_t *client = NULL;
+    job_t *job = NULL;
+
+    pthread_mutex_lock(&mutex_clients);
+    clients_reading++;
+    pthread_mutex_unlock(&mutex_clients);
+
+    pthread_rwlock_rdlock(&rwlock_cfd);
+    HASH_FIND_INT(clients_by_fd, &send->fd, client);
+    pthread_rwlock_unlock(&rwlock_cfd);
+
+    /* A newer template will have been (or is being) sent out already */
+    if (client && client->serial == send->serial && client->active_jobs
+            && send->block_template == template_current())
+        job = bstack_get(client->active_jobs, send->seq);
+    if (job && memcmp(job->id, send->job_id, JOB_ID_SIZE) == 0)
+    {
+        job->hashing_blob_size = send->hashing_blob_size;
+        memcpy(job->hashing_blob, send->hashing_blob,
+                send->hashing_blob_size);
+        evbuffer_add_buffer(bufferevent_get_output(client->bev), send->body);
+    }
+
+    pthread_mutex_lock(&mutex_clients);
+    clients_reading--;
+    pthread_cond_signal(&cond_clients);
+    pthread_mutex_unlock(&mutex_clients);
+
+    if (send->body)
+        evbuffer_free(send->body);
+    slab_put(reactor->slab_broadcast, send);
+    if (--reactor->broadcast_pending == 0)
+        broadcast_finish();
+}
+
+static int
+client_rank_compare(const void *a, const void *b)
+{
+    const client_rank_t *ra = (const client_rank_t*) a;
+    const client_rank_t *rb = (const client_rank_t*) b;
+    return (ra->hr < rb->hr) - (ra->hr > rb->hr);
+}
+
 static void
 clients_send_job(void)
 {
+    /*
+      Miners are sent the new job highest hashrate first, as they waste the
+      most whilst still hashing on the old one. With broadcast threads, the
+      jobs are settled here but built on the threads, and only written out
+      as each is handed back. Each stratum thread sends to its own clients,
+      picking them out of the shared bag with its own cursor whilst holding
+      mutex_clients. Only the owning thread removes a client, so the ones
+      picked stay put once the mutex is released, and clients_reading keeps
+      the bag from being grown under them.
+    */
     log_trace("Sending jobs");
-    client_t *c = (client_t*) gbag_first(bag_clients);
-    while ((c = gbag_next(bag_clients, 0)))
+    reactor_t *r = reactor;
+    size_t count = 0;
+    r->broadcast_start = monotonic_us();
+
+    pthread_mutex_lock(&mutex_clients);
+    clients_reading++;
+    size_t max = gbag_used(bag_clients);
+    if (max > r->broadcast_ranks_max)
+    {
+        r->broadcast_ranks_max = max;
+        r->broadcast_ranks = realloc(r->broadcast_ranks,
+                max * sizeof(client_rank_t));
+    }
+    void *it = NULL;
+    client_t *c = NULL;
+    while ((c = gbag_next_r(bag_clients, &it)) && count < max)
     {
-        if (c->fd == 0 || c->address[0] == 0 || c->downstream)
+        if (c->fd == 0 || !c->account || c->downstream
+                || c->reactor != r)
+            continue;
+        r->broadcast_ranks[count].hr = c->hr_stats.avg[0];
+        r->broadcast_ranks[count++].client = c;
+    }
+    pthread_mutex_unlock(&mutex_clients);
+    qsort(r->broadcast_ranks, count, sizeof(client_rank_t),
+            client_rank_compare);
+
+    for (size_t i=0; i<count; i++)
+    {
+        c = r->broadcast_ranks[i].client;
+        if (!r->broadcaster || c->mode == MODE_SELF_SELECT)
+        {
+            miner_send_job(c, false);
+            continue;
+        }
+        job_send_t *send = slab_get(r->slab_broadcast);
+        job_t *job = job_prepare(c, send, false);
+        if (!send->block_template)
+        {
+            log_warn("Cannot send client a job: No block template");
+            slab_put(r->slab_broadcast, send);
+            continue;
+        }
+        if (wpool_push(r->broadcaster, send))
+        {
+            job_build(send, bufferevent_get_output(c->bev));
+            job->hashing_blob_size = send->hashing_blob_size;
+            memcpy(job->hashing_blob, send->hashing_blob,
+                    send->hashing_blob_size);
+            slab_put(r->slab_broadcast, send);
             continue;
-        miner_send_job(c, false);
+        }
+        r->broadcast_pending++;
     }
+
+    pthread_mutex_lock(&mutex_clients);
+    clients_reading--;
+    pthread_cond_signal(&cond_clients);
+    pthread_mutex_unlock(&mutex_clients);
+
+    __atomic_add_fetch(&pool_metrics.broadcasts, 1, __ATOMIC_RELAXED);
+    pool_metrics.broadcast_clients = count;
+    if (!r->broadcast_pending)
+        broadcast_finish();
+}
+
+static void
+reactor_on_send_jobs(evutil_socket_t fd, short event, void *arg)
+{
+    clients_send_job();
+}
+
+static void
+reactors_send_job(void)
+{
+    /* Other stratum threads are woken to send to their own clients */
+    for (unsigned i=1; i<config.stratum_threads; i++)
+        event_active(reactors[i].send_jobs, 0, 0);
+    clients_send_job();
 }
 
 static void
 clients_init(void)
 {
-    gbag_new(&bag_accounts, CLIENTS_INIT, sizeof(account_t), 0,
-            accounts_moved);
     gbag_new(&bag_clients, CLIENTS_INIT, sizeof(client_t), 0,
             clients_moved);
+    job_bodies_ss_init();
 }
 
 static void
 clients_free(void)
 {
-    if (!(bag_accounts && bag_clients))
+    if (!bag_clients)
         return;
 
     client_t *c = (client_t*) gbag_first(bag_clients);
@@ -1554,6 +3274,13 @@ clients_free(void)
     {
         if (!c->active_jobs)
             continue;
+        /* Verifier has been stopped and drained by now */
+        submission_t *s;
+        while ((s = c->pending))
+        {
+            c->pending = s->next;
+            submission_free(s);
+        }
         client_clear_jobs(c);
     }
     pthread_rwlock_wrlock(&rwlock_cfd);
@@ -1562,9 +3289,11 @@ clients_free(void)
     pthread_rwlock_unlock(&rwlock_cfd);
 
     pthread_rwlock_wrlock(&rwlock_acc);
-    HASH_CLEAR(hh, accounts);
-    gbag_free(bag_accounts);
+    accounts_free();
     pthread_rwlock_unlock(&rwlock_acc);
+
+    job_body_free(&job_bodies_ss[JOB_BODY_NOTIFY]);
+    job_body_free(&job_bodies_ss[JOB_BODY_RESPONSE]);
 }
 
 static void
@@ -1581,13 +3310,21 @@ response_to_block_template(json_object *result,
     block_template->hashing_blob = strdup(json_object_get_string(
                 blockhashing_blob));
     INPLACE_TO_BIN(block_template->hashing_blob);
-    block_template->block_blob = strdup(json_object_get_string(
+    block_template->block_hex = strdup(json_object_get_string(
                 blocktemplate_blob));
+    block_template->block_blob = strdup(block_template->block_hex);
     INPLACE_TO_BIN(block_template->block_blob);
     block_template->difficulty = json_object_get_int64(difficulty);
     block_template->height = json_object_get_int64(height);
     strncpy(block_template->prev_hash, json_object_get_string(prev_hash), 64);
     block_template->reserved_offset = json_object_get_int(reserved_offset);
+    if (get_hashing_template((const unsigned char*)block_template->block_blob,
+                block_template->block_blob_size,
+                &block_template->hashing_template))
+    {
+        log_warn("Cannot create hashing template; "
+                "jobs will need a full block parse");
+    }
 
     uint8_t major_version = *block_template->block_blob;
     uint8_t pow_variant = major_version >= 7 ? major_version - 6 : 0;
@@ -1600,6 +3337,8 @@ response_to_block_template(json_object *result,
     if (pow_variant >= 6)
     {
         unsigned char seed_hash_bin[32] = {0};
+        unsigned char next_seed_hash_bin[32] = {0};
+        const unsigned char *next = NULL;
         JSON_GET_OR_WARN(seed_hash, result, json_type_string);
         JSON_GET_OR_WARN(next_seed_hash, result, json_type_string);
         strncpy(block_template->seed_hash,
@@ -1607,7 +3346,13 @@ response_to_block_template(json_object *result,
         strncpy(block_template->next_seed_hash,
                 json_object_get_string(next_seed_hash), 64);
         hex_to_bin(block_template->seed_hash, seed_hash_bin, 32);
-        set_rx_main_seedhash(seed_hash_bin);
+        if (strlen(block_template->next_seed_hash) == 64)
+        {
+            hex_to_bin(block_template->next_seed_hash,
+                    next_seed_hash_bin, 32);
+            next = next_seed_hash_bin;
+        }
+        rx_seed_set(seed_hash_bin, next);
     }
 }
 
@@ -1786,44 +3531,6 @@ rpc_on_block_header_by_height(const char* data, rpc_callback_t *callback)
     json_object_put(root);
 }
 
-static void
-rpc_on_block_headers_range(const char* data, rpc_callback_t *callback)
-{
-    json_object *root = json_tokener_parse(data);
-    JSON_GET_OR_WARN(result, root, json_type_object);
-    JSON_GET_OR_WARN(status, result, json_type_string);
-    const char *ss = json_object_get_string(status);
-    json_object *error = NULL;
-    json_object_object_get_ex(root, "error", &error);
-    if (error)
-    {
-        JSON_GET_OR_WARN(code, error, json_type_object);
-        JSON_GET_OR_WARN(message, error, json_type_string);
-        int ec = json_object_get_int(code);
-        const char *em = json_object_get_string(message);
-        log_warn("Error (%d) getting block headers by range: %s", ec, em);
-        json_object_put(root);
-        return;
-    }
-    if (!status || strcmp(ss, "OK"))
-    {
-        log_warn("Error getting block headers by range: %s", ss);
-        json_object_put(root);
-        return;
-    }
-
-    JSON_GET_OR_WARN(headers, result, json_type_array);
-    size_t headers_len = json_object_array_length(headers);
-    for (size_t i=0; i<headers_len; i++)
-    {
-        json_object *header = json_object_array_get_idx(headers, i);
-        block_t *bh = &block_headers_range[i];
-        response_to_block(header, bh);
-    }
-    process_blocks(block_headers_range, BLOCK_HEADERS_RANGE);
-    json_object_put(root);
-}
-
 static void
 rpc_on_block_template(const char* data, rpc_callback_t *callback)
 {
@@ -1854,98 +3561,386 @@ rpc_on_block_template(const char* data, rpc_callback_t *callback)
     pool_stats.last_template_fetched = time(NULL);
     response_to_block_template(result, &cand);
 
-    if ((top = bstack_top(bst)))
+    if ((top = bstack_top(bst))
+            && cand.tx_count <= top->tx_count && cand.height <= top->height)
     {
-        if (cand.tx_count > top->tx_count || cand.height > top->height)
-        {
-            log_trace("Using new template, height: %"PRIu64", txs: %"PRIu64,
-                    cand.height, cand.tx_count);
-            bstack_push(bst, &cand);
-        }
-        else
-        {
-            free(cand.hashing_blob);
-            free(cand.block_blob);
-            goto done;
-        }
+        template_recycle(&cand);
+        goto done;
     }
-    else
-        bstack_push(bst, &cand);
+    log_trace("Using new template, height: %"PRIu64", txs: %"PRIu64,
+            cand.height, cand.tx_count);
+    template_build_bodies(&cand);
+    pthread_rwlock_wrlock(&rwlock_tpl);
+    bstack_push(bst, &cand);
+    pthread_rwlock_unlock(&rwlock_tpl);
 
-    clients_send_job();
+    reactors_send_job();
 
 done:
     json_object_put(root);
 }
 
 static int
-startup_scan_round_shares(void)
+round_scan_rollups(MDB_txn *txn, MDB_cursor *shares)
 {
+    /*
+      Adds up the round from the rollups, newest height first. The height
+      where the last block was found holds shares from both rounds, so that
+      one is summed from its raw shares instead.
+    */
     int rc = 0;
-    char *err = NULL;
-    MDB_txn *txn = NULL;
     MDB_cursor *cursor = NULL;
+    MDB_val k, v;
+    MDB_cursor_op op = MDB_LAST;
+    uint64_t height = 0, sum = 0;
+    bool started = false, boundary = false;
+    time_t lbf = pool_stats.last_block_found;
 
-    if (*config.upstream_host)
-        return 0;
-
-    if ((rc = pdb_txn_begin(env, NULL, MDB_RDONLY, &txn)))
-    {
-        err = mdb_strerror(rc);
-        log_error("%s", err);
-        return rc;
-    }
-    if ((rc = mdb_cursor_open(txn, db_shares, &cursor)))
-    {
-        err = mdb_strerror(rc);
-        log_error("%s", err);
-        mdb_txn_abort(txn);
+    if ((rc = mdb_cursor_open(txn, db_rollups, &cursor)))
         return rc;
-    }
-    MDB_cursor_op op = MDB_LAST;
     while (1)
     {
-        MDB_val key;
-        MDB_val val;
-        if ((rc = mdb_cursor_get(cursor, &key, &val, op)))
+        rc = mdb_cursor_get(cursor, &k, &v, op);
+        op = MDB_PREV;
+        const rollup_key_t *rk = (const rollup_key_t*) k.mv_data;
+        if (rc || rk->height != height)
         {
-            if (rc != MDB_NOTFOUND)
-            {
-                err = mdb_strerror(rc);
-                log_error("%s", err);
+            if (started && boundary)
+                break;
+            pool_stats.round_hashes += sum;
+            if (rc)
+                break;
+            height = rk->height;
+            sum = 0;
+            started = true;
+        }
+        const rollup_t *r = (const rollup_t*) v.mv_data;
+        if (r->first > lbf)
+            sum += r->difficulty;
+        else
+            boundary = true;
+    }
+    mdb_cursor_close(cursor);
+    if (rc && rc != MDB_NOTFOUND)
+        return rc;
+    if (!boundary)
+        return 0;
+
+    k.mv_size = sizeof(height);
+    k.mv_data = &height;
+    op = MDB_SET;
+    while (!(rc = mdb_cursor_get(shares, &k, &v, op)))
+    {
+        op = MDB_NEXT_DUP;
+        const share_rec_t *sr = (const share_rec_t*) v.mv_data;
+        if (sr->timestamp > lbf)
+            pool_stats.round_hashes += sr->difficulty;
+    }
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+static int
+round_checkpoint(void)
+{
+    /*
+      Folds the current round's shares into a running total kept in the
+      properties table, so startup need only add the shares above it. The
+      newest ROUND_TAIL_HEIGHTS heights are left out, as shares for recent
+      templates can still arrive there. Shares a downstream pool relays
+      from its backlog below the checkpoint are not counted after a
+      restart.
+    */
+    int rc = 0;
+    char *err = NULL;
+    MDB_txn *txn = NULL;
+    MDB_cursor *cursor = NULL;
+    MDB_val k, v;
+    round_checkpoint_t cp = {0};
+    uint64_t h = 0, rows = 0;
+
+    if (*config.upstream_host || migrating)
+        return 0;
+    if ((rc = pdb_txn_begin(env, NULL, 0, &txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        return rc;
+    }
+    if ((rc = mdb_cursor_open(txn, db_blocks, &cursor)))
+        goto abort;
+    if (!(rc = mdb_cursor_get(cursor, &k, &v, MDB_LAST)))
+    {
+        const block_t *block = (const block_t*) v.mv_data;
+        cp.block_height = cp.height = block->height;
+        cp.block_time = block->timestamp;
+    }
+    mdb_cursor_close(cursor);
+    cursor = NULL;
+    if (rc && rc != MDB_NOTFOUND)
+        goto abort;
+
+    /* A new round starts over from the height of its block */
+    k.mv_data = "round_checkpoint";
+    k.mv_size = strlen(k.mv_data);
+    if (!(rc = mdb_get(txn, db_properties, &k, &v)))
+    {
+        const round_checkpoint_t *pc = (const round_checkpoint_t*) v.mv_data;
+        if (pc->block_height == cp.block_height
+                && pc->block_time == cp.block_time)
+            memcpy(&cp, pc, sizeof(cp));
+    }
+    else if (rc != MDB_NOTFOUND)
+        goto abort;
+
+    if ((rc = mdb_cursor_open(txn, db_shares, &cursor)))
+        goto abort;
+    if ((rc = mdb_cursor_get(cursor, &k, &v, MDB_LAST)))
+        goto abort;
+    memcpy(&h, k.mv_data, sizeof(h));
+    if (h <= cp.height + ROUND_TAIL_HEIGHTS)
+        goto abort;
+    /* cp.height is the lowest height not yet counted */
+    uint64_t to = h - ROUND_TAIL_HEIGHTS;
+    h = cp.height;
+    k.mv_size = sizeof(h);
+    k.mv_data = &h;
+    MDB_cursor_op op = MDB_SET_RANGE;
+    while (!(rc = mdb_cursor_get(cursor, &k, &v, op)))
+    {
+        op = MDB_NEXT;
+        memcpy(&h, k.mv_data, sizeof(h));
+        if (h >= to)
+            break;
+        if (h != cp.height)
+        {
+            cp.height = h;
+            if (rows >= CHECKPOINT_ROWS_MAX)
+                break;
+        }
+        const share_rec_t *sr = (const share_rec_t*) v.mv_data;
+        if (sr->timestamp > cp.block_time)
+            cp.hashes += sr->difficulty;
+        rows++;
+    }
+    mdb_cursor_close(cursor);
+    cursor = NULL;
+    if (rc && rc != MDB_NOTFOUND)
+        goto abort;
+    if (h >= to || rc == MDB_NOTFOUND)
+        cp.height = to;
+
+    k.mv_data = "round_checkpoint";
+    k.mv_size = strlen(k.mv_data);
+    v.mv_data = &cp;
+    v.mv_size = sizeof(cp);
+    if ((rc = mdb_put(txn, db_properties, &k, &v, 0)))
+        goto abort;
+    if ((rc = mdb_txn_commit(txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        return rc;
+    }
+    log_trace("Round checkpoint at height: %"PRIu64", hashes: %"PRIu64,
+            cp.height, cp.hashes);
+    return 0;
+
+abort:
+    if (cursor)
+        mdb_cursor_close(cursor);
+    mdb_txn_abort(txn);
+    if (!rc || rc == MDB_NOTFOUND)
+        return 0;
+    err = mdb_strerror(rc);
+    log_error("%s", err);
+    return rc;
+}
+
+static int
+round_scan_checkpoint(MDB_txn *txn, MDB_cursor *shares, bool *found)
+{
+    /*
+      Adds the checkpointed total to the shares at and above its height.
+    */
+    int rc = 0;
+    MDB_val k, v;
+    round_checkpoint_t cp;
+    time_t lbf = pool_stats.last_block_found;
+    uint64_t sum = 0;
+
+    *found = false;
+    k.mv_data = "round_checkpoint";
+    k.mv_size = strlen(k.mv_data);
+    if ((rc = mdb_get(txn, db_properties, &k, &v)))
+        return rc == MDB_NOTFOUND ? 0 : rc;
+    memcpy(&cp, v.mv_data, sizeof(cp));
+    if (cp.block_time != lbf)
+        return 0;
+
+    k.mv_size = sizeof(cp.height);
+    k.mv_data = &cp.height;
+    MDB_cursor_op op = MDB_SET_RANGE;
+    while (!(rc = mdb_cursor_get(shares, &k, &v, op)))
+    {
+        op = MDB_NEXT;
+        const share_rec_t *sr = (const share_rec_t*) v.mv_data;
+        if (sr->timestamp > lbf)
+            sum += sr->difficulty;
+    }
+    if (rc != MDB_NOTFOUND)
+        return rc;
+    pool_stats.round_hashes += cp.hashes + sum;
+    *found = true;
+    return 0;
+}
+
+static int
+startup_scan_round_shares(void)
+{
+    int rc = 0;
+    char *err = NULL;
+    MDB_txn *txn = NULL;
+    MDB_cursor *cursor = NULL;
+
+    if (*config.upstream_host)
+        return 0;
+
+    if ((rc = pdb_txn_begin(env, NULL, MDB_RDONLY, &txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        return rc;
+    }
+    if ((rc = mdb_cursor_open(txn, db_shares, &cursor)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        mdb_txn_abort(txn);
+        return rc;
+    }
+    if (!migrating)
+    {
+        bool found = false;
+        if ((rc = round_scan_checkpoint(txn, cursor, &found)) || (!found
+                    && (rc = round_scan_rollups(txn, cursor))))
+        {
+            err = mdb_strerror(rc);
+            log_error("%s", err);
+        }
+        mdb_cursor_close(cursor);
+        mdb_txn_abort(txn);
+        return 0;
+    }
+    /* Unmigrated version 1 shares all sit below the version 2 ones */
+    bool v1 = false;
+    MDB_cursor_op op = MDB_LAST;
+    while (1)
+    {
+        MDB_val key;
+        MDB_val val;
+        if ((rc = mdb_cursor_get(cursor, &key, &val, op)))
+        {
+            if (rc != MDB_NOTFOUND)
+            {
+                err = mdb_strerror(rc);
+                log_error("%s", err);
+            }
+            else if (!v1 && shares_v1)
+            {
+                mdb_cursor_close(cursor);
+                if (!mdb_cursor_open(txn, db_shares_v1, &cursor))
+                {
+                    v1 = true;
+                    op = MDB_LAST;
+                    continue;
+                }
+                cursor = NULL;
             }
             break;
         }
         op = MDB_PREV;
-        share_t *share = (share_t*)val.mv_data;
-        if (share->timestamp > pool_stats.last_block_found)
-            pool_stats.round_hashes += share->difficulty;
+        uint64_t difficulty;
+        time_t timestamp;
+        if (v1)
+        {
+            share_t *share = (share_t*)val.mv_data;
+            difficulty = share->difficulty;
+            timestamp = share->timestamp;
+        }
+        else
+        {
+            share_rec_t *share = (share_rec_t*)val.mv_data;
+            difficulty = share->difficulty;
+            timestamp = share->timestamp;
+        }
+        if (timestamp > pool_stats.last_block_found)
+            pool_stats.round_hashes += difficulty;
         else
             break;
     }
+    if (cursor)
+        mdb_cursor_close(cursor);
+    mdb_txn_abort(txn);
+    return 0;
+}
+
+static int
+startup_blocks(void)
+{
+    int rc = 0;
+    char *err = NULL;
+    MDB_txn *txn = NULL;
+    MDB_cursor *cursor = NULL;
+    MDB_stat st;
+    if ((rc = pdb_txn_begin(env, NULL, MDB_RDONLY, &txn)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        return rc;
+    }
+    if ((rc = mdb_stat(txn, db_blocks, &st))
+            || (rc = mdb_cursor_open(txn, db_blocks, &cursor)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        mdb_txn_abort(txn);
+        return rc;
+    }
+    pool_stats.pool_blocks_found = st.ms_entries;
+    MDB_val key, val;
+    if (!(rc = mdb_cursor_get(cursor, &key, &val, MDB_LAST))
+            && !upstream_event)
+    {
+        block_t *block = (block_t*)val.mv_data;
+        pool_stats.last_block_found = block->timestamp;
+    }
     mdb_cursor_close(cursor);
     mdb_txn_abort(txn);
     return 0;
 }
 
 static int
-startup_payout(uint64_t height)
+unlock_blocks(uint64_t height)
 {
     /*
-      Loop stored blocks < height - 60
-      If block locked & not orphaned, payout
+      Asks the daemon for the chain's block at each height where we hold a
+      locked block now at least 60 deep. Anything still locked after that
+      (say, the request failed) is simply asked about again next height.
     */
     int rc = 0;
     char *err = NULL;
     MDB_txn *txn = NULL;
     MDB_cursor *cursor = NULL;
+    if (height < 60)
+        return 0;
+    flush_shares();
     if ((rc = pdb_txn_begin(env, NULL, MDB_RDONLY, &txn)))
     {
         err = mdb_strerror(rc);
         log_error("%s", err);
         return rc;
     }
-    if ((rc = mdb_cursor_open(txn, db_blocks, &cursor)))
+    if ((rc = mdb_cursor_open(txn, db_locked, &cursor)))
     {
         err = mdb_strerror(rc);
         log_error("%s", err);
@@ -1953,7 +3948,6 @@ startup_payout(uint64_t height)
         return rc;
     }
 
-    pool_stats.pool_blocks_found = 0;
     MDB_cursor_op op = MDB_FIRST;
     while (1)
     {
@@ -1968,22 +3962,15 @@ startup_payout(uint64_t height)
             }
             break;
         }
-        op = MDB_NEXT;
-
-        pool_stats.pool_blocks_found++;
-        block_t *block = (block_t*)val.mv_data;
-
-        if (!upstream_event)
-            pool_stats.last_block_found = block->timestamp;
-
-        if (block->height + 60 > height)
-            continue;
-        if (block->status != BLOCK_LOCKED)
-            continue;
-
+        op = MDB_NEXT_NODUP;
+        uint64_t bh;
+        memcpy(&bh, key.mv_data, sizeof(bh));
+        if (bh + 60 > height)
+            break;
+        log_debug("Checking locked block at height: %"PRIu64, bh);
         char body[RPC_BODY_MAX] = {0};
         rpc_get_request_body(body, "get_block_header_by_height", "sd",
-                "height", block->height);
+                "height", bh);
         rpc_callback_t *cb = rpc_callback_new(
                 rpc_on_block_header_by_height, 0, 0);
         rpc_request(pool_base, body, cb);
@@ -2060,7 +4047,7 @@ rpc_on_last_block_header(const char* data, rpc_callback_t *callback)
         height_changed = true;
         block_t *block = bstack_push(bsh, NULL);
         response_to_block(block_header, block);
-        startup_payout(block->height);
+        startup_blocks();
         startup_scan_round_shares();
     }
 
@@ -2078,16 +4065,8 @@ rpc_on_last_block_header(const char* data, rpc_callback_t *callback)
     rpc_callback_t *cb1 = rpc_callback_new(rpc_on_block_template, 0, 0);
     rpc_request(pool_base, body, cb1);
 
-    if (height_changed && top->height >= BLOCK_HEADERS_RANGE + 60 - 1)
-    {
-        uint64_t end = top->height - 60;
-        uint64_t start = end - BLOCK_HEADERS_RANGE + 1;
-        rpc_get_request_body(body, "get_block_headers_range", "sdsd",
-                "start_height", start, "end_height", end);
-        rpc_callback_t *cb2 = rpc_callback_new(
-                rpc_on_block_headers_range, 0, 0);
-        rpc_request(pool_base, body, cb2);
-    }
+    if (height_changed)
+        unlock_blocks(top->height);
 
     json_object_put(root);
 }
@@ -2124,7 +4103,7 @@ rpc_on_block_submitted(const char* data, rpc_callback_t *callback)
     if (!upstream_event)
     {
         pool_stats.last_block_found = b->timestamp;
-        pool_stats.round_hashes = 0;
+        __atomic_store_n(&pool_stats.round_hashes, 0, __ATOMIC_RELAXED);
     }
     log_info("Block submitted at height: %"PRIu64, b->height);
     if ((rc = store_block(b->height, b)))
@@ -2171,11 +4150,11 @@ rpc_on_wallet_transferred(const char* data, rpc_callback_t *callback)
         goto cleanup;
     }
     gbag_t *bag_pay = (gbag_t*) callback->data;
-    payment_t *p = (payment_t*) gbag_first(bag_pay);
+    payout_t *p = (payout_t*) gbag_first(bag_pay);
     while ((p = gbag_next(bag_pay, 0)))
     {
         MDB_cursor_op op = MDB_SET;
-        MDB_val key = {ADDRESS_MAX, (void*)p->address};
+        MDB_val key = {sizeof(p->address_id), (void*)&p->address_id};
         MDB_val val;
         if ((rc = mdb_cursor_get(cursor, &key, &val, op)))
         {
@@ -2236,12 +4215,12 @@ rpc_on_wallet_transferred(const char* data, rpc_callback_t *callback)
         goto cleanup;
     }
     time_t now = time(NULL);
-    p = (payment_t*) gbag_first(bag_pay);
+    p = (payout_t*) gbag_first(bag_pay);
     while ((p = gbag_next(bag_pay, 0)))
     {
-        p->timestamp = now;
-        MDB_val key = {ADDRESS_MAX, (void*)p->address};
-        MDB_val val = {sizeof(payment_t), p};
+        payment_rec_t pr = {p->amount, now};
+        MDB_val key = {sizeof(p->address_id), (void*)&p->address_id};
+        MDB_val val = {sizeof(pr), (void*)&pr};
         if ((rc = mdb_cursor_put(cursor, &key, &val, MDB_APPENDDUP)))
         {
             err = mdb_strerror(rc);
@@ -2286,7 +4265,7 @@ send_payments(void)
     }
 
     gbag_t *bag_pay = NULL;
-    gbag_new(&bag_pay, 25, sizeof(payment_t), 0, 0);
+    gbag_new(&bag_pay, 25, sizeof(payout_t), 0, 0);
 
     MDB_cursor_op op = MDB_FIRST;
     while (1)
@@ -2297,16 +4276,23 @@ send_payments(void)
             break;
         op = MDB_NEXT;
 
-        const char *address = (const char*)key.mv_data;
+        uint32_t id = 0;
+        memcpy(&id, key.mv_data, sizeof(id));
         uint64_t amount = *(uint64_t*)val.mv_data;
 
         if (amount < threshold)
             continue;
 
-        log_info("Sending payment: %"PRIu64", %.8s", amount, address);
-
-        payment_t *p = (payment_t*) gbag_get(bag_pay);
-        strncpy(p->address, address, ADDRESS_MAX-1);
+        payout_t *p = (payout_t*) gbag_get(bag_pay);
+        if ((rc = address_get(txn, id, p->address)))
+        {
+            err = mdb_strerror(rc);
+            log_error("No address for balance %"PRIu32": %s", id, err);
+            gbag_put(bag_pay, p);
+            continue;
+        }
+        log_info("Sending payment: %"PRIu64", %.8s", amount, p->address);
+        p->address_id = id;
         p->amount = amount;
     }
     mdb_cursor_close(cursor);
@@ -2321,7 +4307,7 @@ send_payments(void)
         char *end = body + body_size;
         start = stecpy(start, "{\"id\":\"0\",\"jsonrpc\":\"2.0\",\"method\":"
                 "\"transfer_split\",\"params\":{\"destinations\":[", end);
-        payment_t *p = (payment_t*) gbag_first(bag_pay);
+        payout_t *p = (payout_t*) gbag_first(bag_pay);
         while ((p = gbag_next(bag_pay, 0)))
         {
             start = stecpy(start, "{\"address\":\"", end);
@@ -2548,7 +4534,7 @@ upstream_send_backlog(void)
     int rc = 0;
     char *err = NULL;
     MDB_txn *txn = NULL;
-    MDB_cursor *curshr = NULL, *curblk = NULL;
+    MDB_cursor *curshr = NULL, *curblk = NULL, *curold = NULL;
     if (!upstream_last_height || !upstream_last_time || !upstream_event)
         return;
     log_info("Sending upstream shares/blocks since: %"PRIu64", %"PRIu64,
@@ -2575,11 +4561,33 @@ upstream_send_backlog(void)
     }
     uint64_t h = upstream_last_height;
     time_t t = upstream_last_time;
-    MDB_cursor_op op = MDB_SET;
+    MDB_cursor_op op = MDB_SET_RANGE;
+    if (shares_v1 && h < migrate_floor
+            && !mdb_cursor_open(txn, db_shares_v1, &curold))
+    {
+        while (1)
+        {
+            MDB_val k, v;
+            if (op == MDB_SET_RANGE)
+            {
+                k.mv_size = sizeof(h);
+                k.mv_data = &h;
+            }
+            if (mdb_cursor_get(curold, &k, &v, op))
+                break;
+            op = MDB_NEXT;
+            share_t *s = (share_t*) v.mv_data;
+            if (s->timestamp <= t)
+                continue;
+            upstream_send_client_share(s);
+        }
+        mdb_cursor_close(curold);
+    }
+    op = MDB_SET_RANGE;
     while (1)
     {
         MDB_val k, v;
-        if (op == MDB_SET)
+        if (op == MDB_SET_RANGE)
         {
             k.mv_size = sizeof(h);
             k.mv_data = &h;
@@ -2587,10 +4595,13 @@ upstream_send_backlog(void)
         if (mdb_cursor_get(curshr, &k, &v, op))
             break;
         op = MDB_NEXT;
-        share_t *s = (share_t*) v.mv_data;
-        if (s->timestamp <= t)
+        share_rec_t *sr = (share_rec_t*) v.mv_data;
+        if (sr->timestamp <= t)
             continue;
-        upstream_send_client_share(s);
+        share_t s = {sr->height, sr->difficulty, {0}, sr->timestamp};
+        if (address_get(txn, sr->address_id, s.address))
+            continue;
+        upstream_send_client_share(&s);
     }
     op = MDB_SET;
     while (1)
@@ -2621,7 +4632,9 @@ trusted_on_account_connect(client_t *client)
     struct evbuffer *input = bufferevent_get_input(client->bev);
     uint32_t count;
     evbuffer_remove(input, &count, sizeof(uint32_t));
+    pthread_rwlock_wrlock(&rwlock_acc);
     pool_stats.connected_accounts += count;
+    pthread_rwlock_unlock(&rwlock_acc);
     client->downstream_accounts += count;
     log_trace("Downstream account connected");
     trusted_send_stats(client);
@@ -2636,8 +4649,10 @@ trusted_on_account_connect(client_t *client)
 static void
 trusted_on_account_disconnect(client_t *client)
 {
+    pthread_rwlock_wrlock(&rwlock_acc);
     if (pool_stats.connected_accounts)
         pool_stats.connected_accounts--;
+    pthread_rwlock_unlock(&rwlock_acc);
     if (client->downstream_accounts)
         client->downstream_accounts--;
     log_trace("Downstream account disconnected");
@@ -2660,13 +4675,18 @@ trusted_on_client_share(client_t *client)
     share_t s;
     int rc = 0;
     evbuffer_remove(input, (void*)&s, sizeof(share_t));
+    s.address[ADDRESS_MAX-1] = 0;
     log_debug("Received share from downstream with difficulty: %"PRIu64,
             s.difficulty);
     client->hashes += s.difficulty;
-    pool_stats.round_hashes += s.difficulty;
+    __atomic_add_fetch(&pool_stats.round_hashes, s.difficulty,
+            __ATOMIC_RELAXED);
     client->hr_stats.diff_since += s.difficulty;
     hr_update(&client->hr_stats);
-    if ((rc = store_share(s.height, &s)))
+    share_rec_t sr = {s.height, s.difficulty, 0, (uint32_t) s.timestamp};
+    if ((rc = address_id(s.address, &sr.address_id)))
+        log_warn("Failed to store share: %s", mdb_strerror(rc));
+    else if ((rc = store_share(&sr)))
         log_warn("Failed to store share: %s", mdb_strerror(rc));
     trusted_send_stats(client);
     trusted_send_balance(client, s.address);
@@ -2683,8 +4703,9 @@ trusted_on_client_block(client_t *client)
     evbuffer_remove(input, (void*)&b, sizeof(block_t));
     pool_stats.pool_blocks_found++;
     pool_stats.last_block_found = b.timestamp;
-    pool_stats.round_hashes = 0;
+    __atomic_store_n(&pool_stats.round_hashes, 0, __ATOMIC_RELAXED);
     log_info("Block submitted by downstream: %.8s, %"PRIu64, b.hash, b.height);
+    flush_shares();
     if ((rc = store_block(b.height, &b)))
         log_warn("Failed to store block: %s", mdb_strerror(rc));
     trusted_send_stats(client);
@@ -2717,6 +4738,7 @@ upstream_on_balance(struct bufferevent *bev)
     struct evbuffer *input = bufferevent_get_input(bev);
     evbuffer_remove(input, &balance, sizeof(uint64_t));
     evbuffer_remove(input, address, ADDRESS_MAX);
+    address[ADDRESS_MAX-1] = 0;
     log_trace("Balance from upstream: %.8s, %"PRIu64, address, balance);
     if ((rc = pdb_txn_begin(env, NULL, 0, &txn)))
     {
@@ -2724,7 +4746,15 @@ upstream_on_balance(struct bufferevent *bev)
         log_error("%s", err);
         return rc;
     }
-    MDB_val k = {ADDRESS_MAX, (void*)address};
+    uint32_t id = 0;
+    if ((rc = address_id_get(txn, address, true, &id)))
+    {
+        err = mdb_strerror(rc);
+        log_error("%s", err);
+        mdb_txn_abort(txn);
+        return rc;
+    }
+    MDB_val k = {sizeof(id), (void*)&id};
     MDB_val v = {sizeof(uint64_t), (void*)&balance};
     if ((rc = mdb_put(txn, db_balance, &k, &v, 0)))
     {
@@ -2834,129 +4864,754 @@ upstream_connect(void)
     }
 
     upstream_event = bufferevent_socket_new(pool_base, -1,
-            BEV_OPT_CLOSE_ON_FREE);
+            BEV_OPT_CLOSE_ON_FREE|BEV_OPT_THREADSAFE);
 
     if (bufferevent_socket_connect(upstream_event,
                 info->ai_addr, info->ai_addrlen) < 0)
     {
-        perror("connect");
-        goto bail;
+        perror("connect");
+        goto bail;
+    }
+
+    bufferevent_setcb(upstream_event,
+            upstream_on_read, NULL, upstream_on_event, NULL);
+    bufferevent_enable(upstream_event, EV_READ|EV_WRITE);
+    evutil_make_socket_nonblocking(bufferevent_getfd(upstream_event));
+
+bail:
+    freeaddrinfo(info);
+}
+
+static void
+timer_on_template(int fd, short kind, void *ctx)
+{
+    struct timeval timeout = {config.template_timeout, 0};
+    time_t now = time(NULL);
+    time_t offset = difftime(now, template_triggered);
+    if (offset < config.template_timeout)
+        timeout.tv_sec -= offset;
+    else
+    {
+        log_trace("Fetching last block header from timer");
+        fetch_last_block_header();
+    }
+    evtimer_add(timer_template, &timeout);
+}
+
+static void
+timer_on_10s(int fd, short kind, void *ctx)
+{
+    log_info("Reconnecting to upstream: %s:%d",
+            config.upstream_host, config.upstream_port);
+    upstream_connect();
+}
+
+static void
+timer_on_30s(int fd, short kind, void *ctx)
+{
+    if (upstream_event)
+        upstream_send_ping();
+    struct timeval timeout = { .tv_sec = 30, .tv_usec = 0 };
+    evtimer_add(timer_30s, &timeout);
+}
+
+static int
+height_rollups_rebuild(MDB_txn *txn, MDB_cursor *cursor_r,
+        MDB_cursor *cursor, MDB_cursor *cursor_v1, uint64_t height,
+        rollup_buf_t *rb)
+{
+    /* Replaces a height's rollups with sums of its remaining shares */
+    int rc = 0;
+    MDB_val k, v;
+    while (1)
+    {
+        rollup_key_t rk = {height, 0, 0};
+        k.mv_size = sizeof(rk);
+        k.mv_data = &rk;
+        if ((rc = mdb_cursor_get(cursor_r, &k, &v, MDB_SET_RANGE))
+                || ((rollup_key_t*)k.mv_data)->height != height)
+            break;
+        if ((rc = mdb_cursor_del(cursor_r, 0)))
+            break;
+    }
+    if (rc && rc != MDB_NOTFOUND)
+        return rc;
+    if ((rc = height_shares(txn, cursor, cursor_v1, height, rb)))
+        return rc;
+    for (size_t i=0; i<rb->count; i++)
+    {
+        rollup_entry_t *e = &rb->entries[i];
+        rollup_key_t rk = {height, e->address_id, e->share_difficulty};
+        rollup_t r = {e->difficulty, e->first, e->last};
+        MDB_val nk = { sizeof(rk), (void*)&rk };
+        MDB_val nv = { sizeof(r), (void*)&r };
+        if ((rc = mdb_put(txn, db_rollups, &nk, &nv, 0)))
+            return rc;
+    }
+    return 0;
+}
+
+static void
+timer_on_migrate(int fd, short kind, void *ctx)
+{
+    /*
+      Works down from the floor a whole height at a time, moving any
+      version 1 shares to version 2 and rebuilding the height's rollups
+      from its shares. Yields to the event loop after MIGRATE_SHARES_MAX
+      rows. Heights at or above the floor are complete, so readers only
+      fall back to raw shares below it.
+    */
+    static uint64_t migrated;
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+    int rc = 0;
+    MDB_txn *txn = NULL;
+    MDB_cursor *cursor = NULL;
+    MDB_cursor *cursor_v1 = NULL;
+    MDB_cursor *cursor_r = NULL;
+    MDB_val k, v;
+    uint64_t moved = 0;
+    uint64_t height = migrate_floor;
+    bool done = false;
+    rollup_buf_t rb = {0};
+
+    if ((rc = pdb_txn_begin(env, NULL, 0, &txn)))
+    {
+        log_error("%s", mdb_strerror(rc));
+        goto retry;
+    }
+    if ((rc = mdb_cursor_open(txn, db_rollups, &cursor_r))
+            || (rc = mdb_cursor_open(txn, db_shares, &cursor))
+            || (shares_v1
+                && (rc = mdb_cursor_open(txn, db_shares_v1, &cursor_v1))))
+    {
+        log_error("%s", mdb_strerror(rc));
+        goto abort;
+    }
+    while (moved < MIGRATE_SHARES_MAX)
+    {
+        uint64_t prev = 0, h = 0;
+        bool found = false;
+        MDB_val at = {sizeof(height), (void*)&height};
+        MDB_cursor *curs[] = {cursor, cursor_v1};
+        for (int i=0; i<2; i++)
+        {
+            if (!curs[i])
+                continue;
+            if (!(rc = height_prev(curs[i], &at, &h)))
+            {
+                prev = found ? MAX(prev, h) : h;
+                found = true;
+            }
+            else if (rc != MDB_NOTFOUND)
+            {
+                log_error("%s", mdb_strerror(rc));
+                goto abort;
+            }
+        }
+        if (!found)
+        {
+            done = true;
+            break;
+        }
+        height = prev;
+
+        k.mv_size = sizeof(height);
+        k.mv_data = &height;
+        MDB_cursor_op op = MDB_SET;
+        while (cursor_v1 && !(rc = mdb_cursor_get(cursor_v1, &k, &v, op)))
+        {
+            op = MDB_NEXT_DUP;
+            share_rec_t sr;
+            if ((rc = share_from_v1(txn, (share_t*)v.mv_data, &sr)))
+            {
+                if (rc != EINVAL)
+                    break;
+                log_warn("Dropping share with invalid address at height: "
+                        "%"PRIu64, height);
+                continue;
+            }
+            MDB_val nk = { sizeof(height), (void*)&height };
+            MDB_val nv = { sizeof(share_rec_t), (void*)&sr };
+            if ((rc = mdb_put(txn, db_shares, &nk, &nv, 0)))
+                break;
+            moved++;
+        }
+        if (cursor_v1 && rc != MDB_NOTFOUND)
+        {
+            log_error("%s", mdb_strerror(rc));
+            goto abort;
+        }
+        if (cursor_v1 && op == MDB_NEXT_DUP)
+        {
+            k.mv_size = sizeof(height);
+            k.mv_data = &height;
+            if ((rc = mdb_cursor_get(cursor_v1, &k, &v, MDB_SET))
+                    || (rc = mdb_cursor_del(cursor_v1, MDB_NODUPDATA)))
+            {
+                log_error("%s", mdb_strerror(rc));
+                goto abort;
+            }
+        }
+
+        if ((rc = height_rollups_rebuild(txn, cursor_r, cursor, NULL,
+                        height, &rb)))
+        {
+            log_error("%s", mdb_strerror(rc));
+            goto abort;
+        }
+        moved += rb.rows;
+    }
+    mdb_cursor_close(cursor_r);
+    mdb_cursor_close(cursor);
+    if (cursor_v1)
+        mdb_cursor_close(cursor_v1);
+    cursor_r = cursor = cursor_v1 = NULL;
+    k.mv_data = "migrate_floor";
+    k.mv_size = strlen(k.mv_data);
+    if (done)
+    {
+        uint32_t version = SCHEMA_VERSION;
+        if ((rc = mdb_del(txn, db_properties, &k, NULL))
+                && rc != MDB_NOTFOUND)
+        {
+            log_error("%s", mdb_strerror(rc));
+            goto abort;
+        }
+        k.mv_data = "schema_version";
+        k.mv_size = strlen(k.mv_data);
+        v.mv_data = &version;
+        v.mv_size = sizeof(version);
+    }
+    else
+    {
+        v.mv_data = &height;
+        v.mv_size = sizeof(height);
+    }
+    if ((rc = mdb_put(txn, db_properties, &k, &v, 0)))
+    {
+        log_error("%s", mdb_strerror(rc));
+        goto abort;
+    }
+    if ((rc = mdb_txn_commit(txn)))
+    {
+        log_error("%s", mdb_strerror(rc));
+        goto retry;
+    }
+    free(rb.entries);
+    migrated += moved;
+    migrate_floor = height;
+    if (done)
+    {
+        migrating = false;
+        shares_v1 = false;
+        log_info("Share migration complete, rows: %"PRIu64, migrated);
+        return;
+    }
+    log_debug("Migrated shares down to height: %"PRIu64", rows: %"PRIu64,
+            height, migrated);
+    evtimer_add(timer_migrate, &timeout);
+    return;
+
+abort:
+    if (cursor_r)
+        mdb_cursor_close(cursor_r);
+    if (cursor)
+        mdb_cursor_close(cursor);
+    if (cursor_v1)
+        mdb_cursor_close(cursor_v1);
+    mdb_txn_abort(txn);
+retry:
+    free(rb.entries);
+    timeout.tv_sec = 10;
+    timeout.tv_usec = 0;
+    evtimer_add(timer_migrate, &timeout);
+}
+
+static void
+timer_on_checkpoint(int fd, short kind, void *ctx)
+{
+    accounts_checkpoint();
+    if (abattoir)
+        round_checkpoint();
+}
+
+static inline time_t
+share_time(bool v1, const MDB_val *val)
+{
+    if (v1)
+        return ((const share_t*)val->mv_data)->timestamp;
+    return ((const share_rec_t*)val->mv_data)->timestamp;
+}
+
+static int
+cull_first_height(MDB_cursor *cursor, bool v1, uint64_t *rows, bool *reached)
+{
+    /*
+      Culls the lowest height in a shares table. The whole height goes in
+      one delete if even its newest share is older than the cut, otherwise
+      just the shares before the cut, which is then reached.
+    */
+    int rc = 0;
+    size_t n = 0;
+    MDB_val k, v;
+    if ((rc = mdb_cursor_get(cursor, &k, &v, MDB_FIRST))
+            || (rc = mdb_cursor_get(cursor, &k, &v, MDB_LAST_DUP)))
+        return rc;
+    if (share_time(v1, &v) < cull_cut)
+    {
+        if ((rc = mdb_cursor_count(cursor, &n))
+                || (rc = mdb_cursor_del(cursor, MDB_NODUPDATA)))
+            return rc;
+        *rows += n;
+        return 0;
+    }
+    *reached = true;
+    while (!(rc = mdb_cursor_get(cursor, &k, &v, MDB_FIRST))
+            && share_time(v1, &v) < cull_cut)
+    {
+        if ((rc = mdb_cursor_del(cursor, 0)))
+            return rc;
+        (*rows)++;
+    }
+    return rc;
+}
+
+static void
+timer_on_cull(int fd, short kind, void *ctx)
+{
+    /*
+      Culls shares older than cull_cut a slice at a time, each slice its
+      own txn of at most CULL_ROWS_MAX rows or CULL_SLICE_US, so neither
+      the event loop nor the freelist has to take one huge txn.
+    */
+    static uint64_t culled;
+    static uint64_t started;
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+    int rc = 0;
+    MDB_txn *txn = NULL;
+    MDB_cursor *cursor = NULL;
+    MDB_val k, v;
+    uint64_t start = monotonic_us();
+    uint64_t rows = 0;
+    uint64_t keep = UINT64_MAX;
+    uint64_t before = 0;
+    bool reached = false, spent = false, partial = false;
+    rollup_buf_t rb = {0};
+
+    if (!started)
+        started = start;
+    if ((rc = pdb_txn_begin(env, NULL, 0, &txn)))
+    {
+        log_error("%s", mdb_strerror(rc));
+        goto retry;
+    }
+    /* Unmigrated version 1 shares are the oldest, so are culled first */
+    MDB_dbi dbis[] = {db_shares_v1, db_shares};
+    for (int i=shares_v1 ? 0 : 1; i<2 && !reached && !spent; i++)
+    {
+        if ((rc = mdb_cursor_open(txn, dbis[i], &cursor)))
+            goto abort;
+        while (!reached)
+        {
+            if (rows >= CULL_ROWS_MAX
+                    || monotonic_us() - start >= CULL_SLICE_US)
+            {
+                spent = true;
+                break;
+            }
+            before = rows;
+            if ((rc = cull_first_height(cursor, !i, &rows, &reached)))
+                break;
+            partial = reached && rows > before;
+        }
+        mdb_cursor_close(cursor);
+        cursor = NULL;
+        if (rc && rc != MDB_NOTFOUND)
+            goto abort;
+    }
+
+    /*
+      Rollups go once every share at their height has. A height culled in
+      part is the lowest left, so is keep, and any rollups it has are
+      rebuilt from the shares that remain.
+    */
+    for (int i=shares_v1 ? 0 : 1; i<2 && keep == UINT64_MAX; i++)
+    {
+        if ((rc = mdb_cursor_open(txn, dbis[i], &cursor)))
+            goto abort;
+        if (!(rc = mdb_cursor_get(cursor, &k, &v, MDB_FIRST)))
+            memcpy(&keep, k.mv_data, sizeof(keep));
+        mdb_cursor_close(cursor);
+        cursor = NULL;
+        if (rc && rc != MDB_NOTFOUND)
+            goto abort;
+    }
+    if ((rc = mdb_cursor_open(txn, db_rollups, &cursor)))
+        goto abort;
+    while (!(rc = mdb_cursor_get(cursor, &k, &v, MDB_FIRST))
+            && ((rollup_key_t*)k.mv_data)->height < keep)
+    {
+        if ((rc = mdb_cursor_del(cursor, 0)))
+            break;
+    }
+    if (partial && !rc && ((rollup_key_t*)k.mv_data)->height == keep)
+    {
+        MDB_cursor *cursor_s = NULL, *cursor_v1 = NULL;
+        if (!(rc = mdb_cursor_open(txn, db_shares, &cursor_s))
+                && (!shares_v1
+                    || !(rc = mdb_cursor_open(txn, db_shares_v1,
+                            &cursor_v1))))
+            rc = height_rollups_rebuild(txn, cursor, cursor_s, cursor_v1,
+                    keep, &rb);
+        if (cursor_v1)
+            mdb_cursor_close(cursor_v1);
+        if (cursor_s)
+            mdb_cursor_close(cursor_s);
+        free(rb.entries);
+    }
+    mdb_cursor_close(cursor);
+    cursor = NULL;
+    if (rc && rc != MDB_NOTFOUND)
+        goto abort;
+    if ((rc = mdb_txn_commit(txn)))
+    {
+        log_error("%s", mdb_strerror(rc));
+        goto retry;
+    }
+
+    culled += rows;
+    pool_metrics.shares_culled += rows;
+    pool_metrics.cull_height = keep == UINT64_MAX ? 0 : keep;
+    if (spent)
+    {
+        log_debug("Culled shares: %"PRIu64", up to height: %"PRIu64,
+                culled, keep);
+        evtimer_add(timer_cull, &timeout);
+        return;
+    }
+    log_debug("Culled shares: %"PRIu64" in %"PRIu64" ms", culled,
+            (monotonic_us() - started) / 1000);
+    culled = started = 0;
+    cull_cut = 0;
+    return;
+
+abort:
+    log_error("%s", mdb_strerror(rc));
+    if (cursor)
+        mdb_cursor_close(cursor);
+    mdb_txn_abort(txn);
+retry:
+    timeout.tv_sec = 10;
+    timeout.tv_usec = 0;
+    evtimer_add(timer_cull, &timeout);
+}
+
+static void
+timer_on_10m(int fd, short kind, void *ctx)
+{
+    struct timeval timeout = { .tv_sec = 600, .tv_usec = 0 };
+
+    if (database_resize())
+        log_warn("DB resize needed, will retry later");
+
+    send_payments();
+
+    /* culling old shares, unless the last pass is still going */
+    if (config.cull_shares > 0 && !cull_cut)
+    {
+        log_debug("Culling shares older than: %d days", config.cull_shares);
+        cull_cut = time(NULL) - config.cull_shares * 86400;
+        timer_on_cull(-1, EV_TIMEOUT, NULL);
+    }
+
+    evtimer_add(timer_10m, &timeout);
+}
+
+static void
+submission_verify(void *item)
+{
+    /* Runs on a verifier thread, so only touches the submission itself */
+    submission_t *s = (submission_t*) item;
+    unsigned char result_hash[32] = {0};
+
+    if (config.disable_hash_check)
+    {
+        s->status = SUBMIT_OK;
+        return;
+    }
+
+    if (s->pow_variant >= 6)
+    {
+        uint64_t start = verifier_node > -1 ? monotonic_us() : 0;
+        if (rx_hash(s->seed_hash, s->blob, s->blob_size, result_hash))
+        {
+            s->error = "Seed hash not available";
+            return;
+        }
+        if (verifier_node > -1)
+        {
+            __atomic_add_fetch(&pool_metrics.node_hashes[verifier_node], 1,
+                    __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pool_metrics.node_hash_time[verifier_node],
+                    monotonic_us() - start, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        get_hash(s->blob, s->blob_size,
+                (unsigned char*)result_hash, s->pow_variant, s->height);
+    }
+
+    __atomic_add_fetch(&pool_metrics.shares_verified, 1, __ATOMIC_RELAXED);
+    if (memcmp(s->result_hash, result_hash, 32))
+    {
+        s->status = SUBMIT_INVALID;
+        return;
+    }
+    s->status = SUBMIT_OK;
+    if (!__atomic_exchange_n(&first_verified, true, __ATOMIC_RELAXED))
+        log_info("First share verified %.1fs after startup",
+                (monotonic_us() - started_us) / 1000000.0);
+}
+
+static void
+template_validate(void *item)
+{
+    /* Runs on a validator thread, so only touches the submission itself */
+    submission_t *s = (submission_t*) item;
+    block_template_t *bt = s->miner_template;
+    int rc = 0;
+
+    INPLACE_TO_BIN(bt->block_blob);
+    if ((rc = validate_block_from_blob((const unsigned char*)bt->block_blob,
+                    bt->block_blob_size, &sec_view[0], &pub_spend[0])))
+    {
+        log_warn("Bad template submitted: %d", rc);
+        s->error = "block template blob invalid";
+        return;
+    }
+    if (get_hashing_blob((const unsigned char*)bt->block_blob,
+                bt->block_blob_size, (unsigned char**)&bt->hashing_blob,
+                &bt->hashing_blob_size)
+            || bt->hashing_blob_size > HASHING_BLOB_MAX)
+    {
+        s->error = "block template blob invalid";
+        return;
+    }
+    s->status = SUBMIT_OK;
+}
+
+static void
+template_process(submission_t *s, struct evbuffer *output, client_t *client)
+{
+    /* Runs on the pool thread once a miner's template has been validated */
+    const char *error = NULL;
+    job_t *job = NULL;
+    if (!client)
+        return;
+    if (!(job = client_find_job(client, s->job_id)))
+        error = "cannot find job with job_id";
+    else if (job->miner_template)
+        error = "job already has block template";
+    if (error)
+    {
+        char body[ERROR_BODY_MAX] = {0};
+        stratum_get_error_body(body, s->json_id, error);
+        evbuffer_add(output, body, strlen(body));
+        return;
+    }
+    job->miner_template = s->miner_template;
+    s->miner_template = NULL;
+    char body[STATUS_BODY_MAX] = {0};
+    stratum_get_status_body(body, s->json_id, "OK");
+    evbuffer_add(output, body, strlen(body));
+}
+
+static void
+submission_process(submission_t *s, client_t *client)
+{
+    /*
+      Runs on the pool thread. The client is NULL when it disconnected
+      whilst the share was being verified, in which case a valid share is
+      still stored (and a block still submitted) but nobody is replied to.
+    */
+    struct evbuffer *output = NULL;
+    if (client)
+        output = bufferevent_get_output(client->bev);
+
+    if (s->error)
+    {
+        if (!output)
+            return;
+        char body[ERROR_BODY_MAX] = {0};
+        stratum_get_error_body(body, s->json_id, s->error);
+        evbuffer_add(output, body, strlen(body));
+        return;
+    }
+    if (s->miner_template)
+    {
+        template_process(s, output, client);
+        return;
+    }
+    if (s->status == SUBMIT_PENDING)
+        return;
+    if (s->status == SUBMIT_INVALID)
+    {
+        if (output)
+        {
+            char body[ERROR_BODY_MAX] = {0};
+            stratum_get_error_body(body, s->json_id, "Invalid share");
+            evbuffer_add(output, body, strlen(body));
+            client->bad_shares++;
+        }
+        log_debug("Invalid share");
+        return;
+    }
+
+    /* Process share */
+    if (client)
+    {
+        account_t *account = client->account;
+        client->hashes += s->target;
+        client->hr_stats.diff_since += s->target;
+        hr_update(&client->hr_stats);
+        /* Workers of one account may be served by different threads */
+        pthread_rwlock_wrlock(&rwlock_acc);
+        account->hashes += s->target;
+        account->hr_stats.diff_since += s->target;
+        /* TODO: account hr should be called less freq */
+        hr_update(&account->hr_stats);
+        pthread_rwlock_unlock(&rwlock_acc);
+    }
+    time_t now = time(NULL);
+    bool can_store = true;
+    bool found = false;
+    log_trace("Checking hash against block difficulty: "
+            "%"PRIu64", job difficulty: %"PRIu64,
+            s->difficulty, s->target);
+
+    if (s->block && check_hash(s->result_hash, s->difficulty))
+    {
+        /* Yay! Mined a block so submit to network */
+        found = true;
+        log_info("+++ MINED A BLOCK +++ "
+                 "address=%.12s, round=%"PRIu64", diff=%"PRIu64", "
+                 "height=%"PRIu64,
+                 s->address,
+                 pool_stats.round_hashes + s->target,
+                 pool_stats.network_difficulty,
+                 pool_stats.network_height);
+        char *block_hex = calloc((s->block_size << 1)+1, sizeof(char));
+        bin_to_hex(s->block, s->block_size, block_hex);
+        char body[RPC_BODY_MAX] = {0};
+        snprintf(body, RPC_BODY_MAX,
+                "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":"
+                "\"submit_block\", \"params\":[\"%s\"]}",
+                block_hex);
+
+        rpc_callback_t *cb = rpc_callback_new(rpc_on_block_submitted, 0, 0);
+        cb->data = calloc(1, sizeof(block_t));
+        block_t* b = (block_t*) cb->data;
+        b->height = s->height;
+        unsigned char block_hash[32] = {0};
+        if (get_block_hash(s->block, s->block_size, block_hash))
+            log_error("Error getting block hash!");
+        bin_to_hex(block_hash, 32, b->hash);
+        memcpy(b->prev_hash, s->prev_hash, 64);
+        b->difficulty = s->difficulty;
+        b->status = BLOCK_LOCKED;
+        b->timestamp = now;
+        if (upstream_event)
+            upstream_send_client_block(b);
+        rpc_request(reactor->base, body, cb);
+        free(block_hex);
+    }
+    else if (!check_hash(s->result_hash, s->target))
+    {
+        can_store = false;
+        if (output)
+        {
+            char body[ERROR_BODY_MAX] = {0};
+            stratum_get_error_body(body, s->json_id, "Low difficulty share");
+            evbuffer_add(output, body, strlen(body));
+            client->bad_shares++;
+        }
+        log_debug("Low difficulty (%"PRIu64") share", s->target);
+    }
+
+    if (can_store)
+    {
+        int rc = 0;
+        if (client && client->bad_shares)
+            client->bad_shares--;
+        share_rec_t share = {s->height, s->target, s->address_id, now};
+        if (!upstream_event)
+            __atomic_add_fetch(&pool_stats.round_hashes, share.difficulty,
+                    __ATOMIC_RELAXED);
+        log_debug("Storing share with difficulty: %"PRIu64, share.difficulty);
+        if ((rc = store_share(&share)))
+            log_warn("Failed to store share: %s", mdb_strerror(rc));
+        if (output)
+        {
+            char body[STATUS_BODY_MAX] = {0};
+            stratum_get_status_body(body, s->json_id, "OK");
+            evbuffer_add(output, body, strlen(body));
+        }
+        if (upstream_event)
+        {
+            share_t us = {s->height, s->target, {0}, now};
+            strcpy(us.address, s->address);
+            upstream_send_client_share(&us);
+        }
+    }
+    if (found)
+        flush_shares();
+    if (!client)
+        return;
+    job_t *job = client_find_job(client, s->job_id);
+    if (job && retarget_required(client, job))
+    {
+        log_debug("Sending an early job as this was less than %u%% of"
+                " potential", (unsigned)(100.*config.retarget_ratio));
+        miner_send_job(client, false);
     }
-
-    bufferevent_setcb(upstream_event,
-            upstream_on_read, NULL, upstream_on_event, NULL);
-    bufferevent_enable(upstream_event, EV_READ|EV_WRITE);
-    evutil_make_socket_nonblocking(bufferevent_getfd(upstream_event));
-
-bail:
-    freeaddrinfo(info);
 }
 
 static void
-timer_on_template(int fd, short kind, void *ctx)
+client_drain_submissions(client_t *client)
 {
-    struct timeval timeout = {config.template_timeout, 0};
-    time_t now = time(NULL);
-    time_t offset = difftime(now, template_triggered);
-    if (offset < config.template_timeout)
-        timeout.tv_sec -= offset;
-    else
+    /* Reply to verified shares, stopping at the first still in flight */
+    submission_t *s = NULL;
+    while ((s = client->pending) && s->done)
     {
-        log_trace("Fetching last block header from timer");
-        fetch_last_block_header();
+        client->pending = s->next;
+        if (!client->pending)
+            client->pending_tail = NULL;
+        client->pending_count--;
+        submission_process(s, client);
+        submission_free(s);
     }
-    evtimer_add(timer_template, &timeout);
-}
-
-static void
-timer_on_10s(int fd, short kind, void *ctx)
-{
-    log_info("Reconnecting to upstream: %s:%d",
-            config.upstream_host, config.upstream_port);
-    upstream_connect();
 }
 
 static void
-timer_on_30s(int fd, short kind, void *ctx)
-{
-    if (upstream_event)
-        upstream_send_ping();
-    struct timeval timeout = { .tv_sec = 30, .tv_usec = 0 };
-    evtimer_add(timer_30s, &timeout);
-}
-
-static void
-timer_on_10m(int fd, short kind, void *ctx)
+client_clear_submissions(client_t *client)
 {
-    struct timeval timeout = { .tv_sec = 600, .tv_usec = 0 };
-    time_t now = time(NULL);
-    int rc = 0;
-    uint64_t cc = 0;
-    time_t cut = now - config.cull_shares * 86400;
-    MDB_txn *txn = NULL;
-    MDB_cursor *cursor = NULL;
-    MDB_cursor_op op = MDB_FIRST;
-    MDB_val k, v;
-
-    if (database_resize())
-        log_warn("DB resize needed, will retry later");
-
-    send_payments();
-
-    /* culling old shares */
-    if (config.cull_shares < 1)
-        goto done;
-    log_debug("Culling shares older than: %d days", config.cull_shares);
-    if ((rc = pdb_txn_begin(env, NULL, 0, &txn)))
-    {
-        log_error("%s", mdb_strerror(rc));
-        goto done;
-    }
-    if ((rc = mdb_cursor_open(txn, db_shares, &cursor)))
-    {
-        log_error("%s", mdb_strerror(rc));
-        goto abort;
-    }
-    while (1)
+    submission_t *s = client->pending;
+    while (s)
     {
-        time_t st;
-        if ((rc = mdb_cursor_get(cursor, &k, &v, op)))
-        {
-            if (rc != MDB_NOTFOUND)
-            {
-                log_error("%s", mdb_strerror(rc));
-                goto abort;
-            }
-            break;
-        }
-        st = ((share_t*)v.mv_data)->timestamp;
-        if (st < cut)
+        submission_t *next = s->next;
+        if (s->done)
         {
-            if ((rc = mdb_cursor_del(cursor, 0)))
-            {
-                log_error("%s", mdb_strerror(rc));
-                goto abort;
-            }
-            cc++;
+            submission_process(s, NULL);
+            submission_free(s);
         }
         else
-            break;
-        op = MDB_NEXT;
+            s->orphaned = true;
+        s = next;
     }
-
-    mdb_cursor_close(cursor);
-    if ((rc = mdb_txn_commit(txn)))
-        log_error("%s", mdb_strerror(rc));
-    else
-        log_debug("Culled shares: %"PRIu64, cc);
-    goto done;
-
-abort:
-    if (cursor)
-        mdb_cursor_close(cursor);
-    mdb_txn_abort(txn);
-done:
-    evtimer_add(timer_10m, &timeout);
+    client->pending = NULL;
+    client->pending_tail = NULL;
+    client->pending_count = 0;
 }
 
 static const client_t *
@@ -2965,21 +5620,24 @@ client_add(int fd, struct sockaddr_storage *ss,
 {
     client_t *c = NULL;
     int rc = 0;
+    pthread_mutex_lock(&mutex_clients);
     bool resize = gbag_used(bag_clients) == gbag_max(bag_clients);
     if (resize)
     {
-        pthread_mutex_lock(&mutex_clients);
         while (clients_reading)
             pthread_cond_wait(&cond_clients, &mutex_clients);
-        c = gbag_get(bag_clients);
-        pthread_mutex_unlock(&mutex_clients);
+    }
+    c = gbag_get(bag_clients);
+    c->fd = fd;
+    c->reactor = reactor;
+    pthread_mutex_unlock(&mutex_clients);
+    if (resize)
+    {
         log_debug("Client pool can now hold %zu clients",
                 gbag_max(bag_clients));
     }
-    else
-        c = gbag_get(bag_clients);
-    c->fd = fd;
     c->bev = bev;
+    c->serial = __atomic_add_fetch(&client_serial, 1, __ATOMIC_RELAXED);
     c->connected_since = time(NULL);
     c->downstream = downstream;
     if ((rc = getnameinfo((struct sockaddr*)ss, sizeof(*ss),
@@ -3019,41 +5677,45 @@ client_clear(struct bufferevent *bev)
 {
     client_t *client = NULL;
     account_t *account = NULL;
+    bool released = false;
     client_find(bev, &client);
     if (!client)
         return;
     if (client->downstream)
     {
+        pthread_rwlock_wrlock(&rwlock_acc);
         if (pool_stats.connected_accounts >= client->downstream_accounts)
             pool_stats.connected_accounts -= client->downstream_accounts;
+        pthread_rwlock_unlock(&rwlock_acc);
         goto clear;
     }
-    pthread_rwlock_rdlock(&rwlock_acc);
-    HASH_FIND_STR(accounts, client->address, account);
-    pthread_rwlock_unlock(&rwlock_acc);
-    if (!account)
+    if (!(account = client->account))
         goto clear;
+    client->account = NULL;
+    pthread_rwlock_wrlock(&rwlock_acc);
     if (account->worker_count == 1)
     {
+        account_release(account);
+        released = true;
         if (account_count)
             account_count--;
         if (pool_stats.connected_accounts)
             pool_stats.connected_accounts--;
-        if (upstream_event)
-            upstream_send_account_disconnect();
-        pthread_rwlock_wrlock(&rwlock_acc);
-        HASH_DEL(accounts, account);
-        pthread_rwlock_unlock(&rwlock_acc);
-        gbag_put(bag_accounts, account);
     }
     else if (account->worker_count > 1)
         account->worker_count--;
+    pthread_rwlock_unlock(&rwlock_acc);
+    if (released && upstream_event)
+        upstream_send_account_disconnect();
 clear:
+    client_clear_submissions(client);
     client_clear_jobs(client);
     pthread_rwlock_wrlock(&rwlock_cfd);
     HASH_DEL(clients_by_fd, client);
     pthread_rwlock_unlock(&rwlock_cfd);
+    pthread_mutex_lock(&mutex_clients);
     gbag_put(bag_clients, client);
+    pthread_mutex_unlock(&mutex_clients);
     bufferevent_free(bev);
 }
 
@@ -3155,31 +5817,41 @@ miner_on_login(json_object *message, client_t *client)
         return;
     }
 
-    strncpy(client->address, address, sizeof(client->address)-1);
+    uint32_t aid = 0;
+    if (address_id(address, &aid))
+    {
+        send_validation_error(client, "Cannot store address");
+        return;
+    }
+
     strncpy(client->worker_id, worker_id, sizeof(client->worker_id)-1);
 
-    account_t *account = NULL;
-    pthread_rwlock_rdlock(&rwlock_acc);
-    HASH_FIND_STR(accounts, client->address, account);
-    pthread_rwlock_unlock(&rwlock_acc);
-    if (!account)
+    account_stats_t as;
+    bool restore = !account_stats_get(aid, &as);
+    bool created = false;
+    pthread_rwlock_wrlock(&rwlock_acc);
+    account_t *account = account_intern(address, &created);
+    if (created)
+    {
+        account->connected_since = time(NULL);
+        account->address_id = aid;
+        if (restore)
+        {
+            account->hashes = as.hashes;
+            account->hr_stats = as.hr_stats;
+        }
+    }
+    account->worker_count++;
+    client->account = account;
+    if (created)
     {
         account_count++;
         if (!client->downstream)
             pool_stats.connected_accounts++;
-        if (upstream_event)
-            upstream_send_account_connect(1);
-        account = gbag_get(bag_accounts);
-        strncpy(account->address, address, sizeof(account->address)-1);
-        account->worker_count = 1;
-        account->connected_since = time(NULL);
-        account->hashes = 0;
-        pthread_rwlock_wrlock(&rwlock_acc);
-        HASH_ADD_STR(accounts, address, account);
-        pthread_rwlock_unlock(&rwlock_acc);
     }
-    else
-        account->worker_count++;
+    pthread_rwlock_unlock(&rwlock_acc);
+    if (created && upstream_event)
+        upstream_send_account_connect(1);
 
     uuid_t cid;
     uuid_generate(cid);
@@ -3190,8 +5862,6 @@ miner_on_login(json_object *message, client_t *client)
 static void
 miner_on_block_template(json_object *message, client_t *client)
 {
-    struct evbuffer *output = bufferevent_get_output(client->bev);
-
     if (client->mode != MODE_SELF_SELECT)
     {
         send_validation_error(client, "Cannot set template; wrong mode");
@@ -3233,14 +5903,6 @@ miner_on_block_template(json_object *message, client_t *client)
     }
 
     const char *btb = json_object_get_string(blob);
-    int rc = 0;
-    if ((rc = validate_block_from_blob(btb, &sec_view[0], &pub_spend[0])))
-    {
-        log_warn("Bad template submitted: %d", rc);
-        send_validation_error(client, "block template blob invalid");
-        return;
-    }
-
     job_t *job = client_find_job(client, jid);
     if (!job)
     {
@@ -3254,47 +5916,63 @@ miner_on_block_template(json_object *message, client_t *client)
         return;
     }
 
-    job->miner_template = calloc(1, sizeof(block_template_t));
-    job->miner_template->block_blob = strdup(btb);
-    INPLACE_TO_BIN(job->miner_template->block_blob);
-    job->miner_template->difficulty = d;
-    job->miner_template->height = h;
-    strncpy(job->miner_template->prev_hash,
-            json_object_get_string(prev_hash), 64);
-
-    uint8_t major_version = *job->miner_template->block_blob;
+    unsigned char major_version = 0;
+    hex_to_bin(btb, &major_version, 1);
     uint8_t pow_variant = major_version >= 7 ? major_version - 6 : 0;
     log_trace("Variant: %u", pow_variant);
 
+    const char *sh = NULL;
+    const char *nsh = NULL;
     if (pow_variant >= 6)
     {
         JSON_GET_OR_ERROR(seed_hash, params, json_type_string, client);
         JSON_GET_OR_WARN(next_seed_hash, params, json_type_string);
-        strncpy(job->miner_template->seed_hash,
-                json_object_get_string(seed_hash), 64);
-        const char *nsh = json_object_get_string(next_seed_hash);
-        if (nsh)
-            strncpy(job->miner_template->next_seed_hash, nsh, 64);
-    }
-
+        sh = json_object_get_string(seed_hash);
+        nsh = json_object_get_string(next_seed_hash);
+    }
+
+    block_template_t *bt = calloc(1, sizeof(block_template_t));
+    if (sh)
+        strncpy(bt->seed_hash, sh, 64);
+    if (nsh)
+        strncpy(bt->next_seed_hash, nsh, 64);
+    bt->block_blob = strdup(btb);
+    bt->difficulty = d;
+    bt->height = h;
+    strncpy(bt->prev_hash, json_object_get_string(prev_hash), 64);
     log_trace("Miner set template: %s", btb);
-    char body[STATUS_BODY_MAX] = {0};
-    stratum_get_status_body(body, client->json_id, "OK");
-    evbuffer_add(output, body, strlen(body));
+
+    /*
+      Parsing the blob and deriving the miner tx output key is left to a
+      validator thread, with the reply queued behind any pending shares.
+    */
+    submission_t *s = submission_new();
+    s->fd = client->fd;
+    s->serial = client->serial;
+    s->json_id = client->json_id;
+    memcpy(s->job_id, jid, 32);
+    s->miner_template = bt;
+    client_push_submission(client, s);
+
+    if (!reactor->validator || wpool_push(reactor->validator, s))
+    {
+        template_validate(s);
+        s->done = true;
+        client_drain_submissions(client);
+    }
 }
 
 static void
-miner_on_submit(json_object *message, client_t *client)
+miner_on_submit(const stratum_msg_t *msg, client_t *client)
 {
-    struct evbuffer *output = bufferevent_get_output(client->bev);
-
-    JSON_GET_OR_ERROR(params, message, json_type_object, client);
-    JSON_GET_OR_ERROR(nonce, params, json_type_string, client);
-    JSON_GET_OR_ERROR(result, params, json_type_string, client);
-    JSON_GET_OR_ERROR(job_id, params, json_type_string, client);
+    if (msg->error)
+    {
+        send_validation_error(client, msg->error);
+        return;
+    }
 
     char *endptr = NULL;
-    const char *nptr = json_object_get_string(nonce);
+    const char *nptr = msg->nonce;
     errno = 0;
     unsigned long int uli = strtoul(nptr, &endptr, 16);
     if (errno || nptr == endptr)
@@ -3304,7 +5982,7 @@ miner_on_submit(json_object *message, client_t *client)
     }
     const uint32_t result_nonce = ntohl(uli);
 
-    const char *result_hex = json_object_get_string(result);
+    const char *result_hex = msg->result;
     if (strlen(result_hex) != 64)
     {
         send_validation_error(client, "result invalid length");
@@ -3316,7 +5994,7 @@ miner_on_submit(json_object *message, client_t *client)
         return;
     }
 
-    const char *jid = json_object_get_string(job_id);
+    const char *jid = msg->job_id;
     if (strlen(jid) != 32)
     {
         send_validation_error(client, "job_id invalid length");
@@ -3333,14 +6011,12 @@ miner_on_submit(json_object *message, client_t *client)
     log_trace("Miner submitted nonce=%u, result=%s, host=%s:%u, "
             "address=%.12s, rig_id=%s",
             result_nonce, result_hex, client->host, client->port,
-            client->address, client->rig_id);
+            client->account->address, client->rig_id);
     /*
       1. Validate submission
-         active_job->block_template->block_blob copy
-         add extra_nonce at reserved offset
+         copy the job's cached hashing blob
          add nonce
-         get hashing blob
-         hash
+         hash (on a verifier thread if enabled)
          compare result
          check result hash against block difficulty (if ge then mined block)
          check result hash against target difficulty (if not ge, invalid share)
@@ -3352,7 +6028,6 @@ miner_on_submit(json_object *message, client_t *client)
       4 bytes each.
     */
 
-    /* Convert template to blob */
     if (client->mode == MODE_SELF_SELECT && !job->miner_template)
     {
         send_validation_error(client, "mode self-select and no template");
@@ -3363,34 +6038,26 @@ miner_on_submit(json_object *message, client_t *client)
         bt = job->miner_template;
     else
         bt = job->block_template;
-    unsigned char *block = calloc(bt->block_blob_size, sizeof(char));
-    memcpy(block, bt->block_blob, bt->block_blob_size);
 
-    unsigned char *p = block;
+    /* Reserved space is: extra_nonce|instance_id|pool_nonce|worker_nonce */
+    unsigned char reserved[16] = {0};
     uint32_t pool_nonce = 0;
     uint32_t worker_nonce = 0;
 
     if (client->mode != MODE_SELF_SELECT)
     {
-        /* Set the extra nonce and instance_id in our reserved space */
-        p += bt->reserved_offset;
-        memcpy(p, &job->extra_nonce, sizeof(extra_nonce));
-        p += 4;
-        memcpy(p, &instance_id, sizeof(instance_id));
+        memcpy(reserved, &job->extra_nonce, sizeof(extra_nonce));
+        memcpy(reserved+4, &instance_id, sizeof(instance_id));
         if (client->is_xnp)
         {
             /*
               A proxy supplies pool_nonce and worker_nonce
               so add them in the reserved space too.
             */
-            JSON_GET_OR_WARN(poolNonce, params, json_type_int);
-            JSON_GET_OR_WARN(workerNonce, params, json_type_int);
-            pool_nonce = json_object_get_int(poolNonce);
-            worker_nonce = json_object_get_int(workerNonce);
-            p += 4;
-            memcpy(p, &pool_nonce, sizeof(pool_nonce));
-            p += 4;
-            memcpy(p, &worker_nonce, sizeof(worker_nonce));
+            pool_nonce = msg->pool_nonce;
+            worker_nonce = msg->worker_nonce;
+            memcpy(reserved+8, &pool_nonce, sizeof(pool_nonce));
+            memcpy(reserved+12, &worker_nonce, sizeof(worker_nonce));
         }
     }
 
@@ -3405,206 +6072,199 @@ miner_on_submit(json_object *message, client_t *client)
     log_trace("Submission reserved values: %u %u %u %u",
             *psub, *(psub+1), *(psub+2), *(psub+3));
 
-    /* Check not already submitted */
-    uint128_t *submissions = job->submissions;
-    for (size_t i=0; i<job->submissions_count; i++)
-    {
-        if (submissions[i] == sub)
-        {
-            char body[ERROR_BODY_MAX] = {0};
-            stratum_get_error_body(body, client->json_id, "Duplicate share");
-            evbuffer_add(output, body, strlen(body));
-            log_debug("[%s:%d] Duplicate share", client->host, client->port);
-            free(block);
-            return;
-        }
-    }
-    if (!fmod(job->submissions_count, 10))
-    {
-        job->submissions = realloc((void*)submissions,
-                10*sizeof(uint128_t)+job->submissions_count*sizeof(uint128_t));
+    /*
+      A share can only be valid if the hash it claims meets the target, so
+      don't spend a hash verifying one that doesn't.
+    */
+    unsigned char result_hash[32] = {0};
+    hex_to_bin(result_hex, result_hash, 32);
+    if (!check_hash(result_hash, job->target))
+    {
+        send_error(client, "Low difficulty share");
+        log_debug("[%s:%d] Low difficulty (%"PRIu64") share claimed",
+                client->host, client->port, job->target);
+        __atomic_add_fetch(&pool_metrics.shares_prefiltered, 1,
+                __ATOMIC_RELAXED);
+        client->bad_shares++;
+        return;
     }
-    job->submissions[job->submissions_count++] = sub;
-
-    /* And the supplied nonce */
-    p = block;
-    p += 39;
-    memcpy(p, &result_nonce, sizeof(result_nonce));
 
-    /* Get hashing blob */
-    size_t hashing_blob_size = 0;
-    unsigned char *hashing_blob = NULL;
-    if (get_hashing_blob(block, bt->block_blob_size,
-                &hashing_blob, &hashing_blob_size) != 0)
+    /* Check not already submitted */
+    if (dupset_add(&job->submissions, sub))
     {
-        char body[ERROR_BODY_MAX] = {0};
-        stratum_get_error_body(body, client->json_id, "Invalid block");
-        evbuffer_add(output, body, strlen(body));
-        log_debug("Invalid block");
-        free(block);
+        send_error(client, "Duplicate share");
+        log_debug("[%s:%d] Duplicate share", client->host, client->port);
+        __atomic_add_fetch(&pool_metrics.shares_duplicate, 1,
+                __ATOMIC_RELAXED);
         return;
     }
 
-    /* Hash and compare */
-    unsigned char result_hash[32] = {0};
-    unsigned char submitted_hash[32] = {0};
-    uint8_t major_version = (uint8_t)block[0];
-    uint8_t pow_variant = major_version >= 7 ? major_version - 6 : 0;
-    BIGNUM *hd = NULL;
-    BIGNUM *jd = NULL;
-    BIGNUM *bd = NULL;
-    BIGNUM *rh = NULL;
-    hex_to_bin(result_hex, submitted_hash, 32);
-
-    if (config.disable_hash_check)
-    {
-        memcpy(result_hash, submitted_hash, 32);
-        goto post_hash;
-    }
+    submission_t *s = submission_new();
 
-    if (pow_variant >= 6)
+    /*
+      The hashing blob only changes by the nonce for a job, so it's cached
+      on the job (or its miner template). A proxy's own nonces end up in the
+      miner tx though, so its blob comes from the block's hashing template.
+    */
+    if (client->mode == MODE_SELF_SELECT)
     {
-        unsigned char seed_hash[32] = {0};
-        hex_to_bin(bt->seed_hash, seed_hash, 32);
-        get_rx_hash(seed_hash, hashing_blob, hashing_blob_size, result_hash);
+        s->blob_size = bt->hashing_blob_size;
+        memcpy(s->blob, bt->hashing_blob, s->blob_size);
     }
-    else
+    else if (!client->is_xnp)
     {
-        get_hash(hashing_blob, hashing_blob_size,
-                (unsigned char*)result_hash, pow_variant, bt->height);
+        s->blob_size = job->hashing_blob_size;
+        memcpy(s->blob, job->hashing_blob, s->blob_size);
     }
-
-    if (memcmp(submitted_hash, result_hash, 32))
+    else if (!bt->hashing_template
+            || get_job_hashing_blob(bt->hashing_template, bt->reserved_offset,
+                reserved, sizeof(reserved), s->blob, &s->blob_size))
     {
-        char body[ERROR_BODY_MAX] = {0};
-        stratum_get_error_body(body, client->json_id, "Invalid share");
-        evbuffer_add(output, body, strlen(body));
-        log_debug("Invalid share");
-        client->bad_shares++;
+        size_t hashing_blob_size = 0;
+        unsigned char *hashing_blob = NULL;
+        unsigned char *block = calloc(bt->block_blob_size, sizeof(char));
+        memcpy(block, bt->block_blob, bt->block_blob_size);
+        memcpy(block + bt->reserved_offset, reserved, sizeof(reserved));
+        int rc = get_hashing_blob(block, bt->block_blob_size,
+                &hashing_blob, &hashing_blob_size);
         free(block);
+        if (rc || hashing_blob_size > HASHING_BLOB_MAX)
+        {
+            send_error(client, "Invalid block");
+            log_debug("Invalid block");
+            free(hashing_blob);
+            submission_free(s);
+            return;
+        }
+        s->blob_size = hashing_blob_size;
+        memcpy(s->blob, hashing_blob, hashing_blob_size);
         free(hashing_blob);
-        return;
     }
 
-post_hash:
-    hd = BN_new();
-    jd = BN_new();
-    bd = BN_new();
-    BN_set_word(jd, job->target);
-    BN_set_word(bd, bt->difficulty);
-    reverse_bin(result_hash, 32);
-    rh = BN_bin2bn((const unsigned char*)result_hash, 32, NULL);
-    BN_div(hd, NULL, base_diff, rh, bn_ctx);
-    BN_free(rh);
+    /* And the supplied nonce */
+    memcpy(s->blob + 39, &result_nonce, sizeof(result_nonce));
+    memcpy(s->result_hash, result_hash, 32);
 
-    /* Process share */
-    account_t *account = NULL;
-    pthread_rwlock_rdlock(&rwlock_acc);
-    HASH_FIND_STR(accounts, client->address, account);
-    client->hashes += job->target;
-    client->hr_stats.diff_since += job->target;
-    account->hashes += job->target;
-    account->hr_stats.diff_since += job->target;
-    hr_update(&client->hr_stats);
-    /* TODO: account hr should be called less freq */
-    hr_update(&account->hr_stats);
-    pthread_rwlock_unlock(&rwlock_acc);
-    time_t now = time(NULL);
-    bool can_store = true;
-    log_trace("Checking hash against block difficulty: "
-            "%lu, job difficulty: %lu",
-            BN_get_word(bd), BN_get_word(jd));
+    /*
+      Only a share claiming to meet the block difficulty needs the block
+      itself, and if it verifies, the claim is true.
+    */
+    if (check_hash(s->result_hash, bt->difficulty))
+    {
+        unsigned char *block = calloc(bt->block_blob_size, sizeof(char));
+        memcpy(block, bt->block_blob, bt->block_blob_size);
+        if (client->mode != MODE_SELF_SELECT)
+            memcpy(block + bt->reserved_offset, reserved, sizeof(reserved));
+        memcpy(block + 39, &result_nonce, sizeof(result_nonce));
+        s->block = block;
+        s->block_size = bt->block_blob_size;
+    }
+
+    /* Hand off for hashing; replies are sent in order as shares complete */
+    uint8_t major_version = (uint8_t)bt->block_blob[0];
+    s->fd = client->fd;
+    s->serial = client->serial;
+    s->json_id = client->json_id;
+    memcpy(s->job_id, jid, 32);
+    s->pow_variant = major_version >= 7 ? major_version - 6 : 0;
+    if (s->pow_variant >= 6)
+        hex_to_bin(bt->seed_hash, s->seed_hash, 32);
+    s->height = bt->height;
+    s->difficulty = bt->difficulty;
+    memcpy(s->prev_hash, bt->prev_hash, 64);
+    s->target = job->target;
+    strcpy(s->address, client->account->address);
+    s->address_id = client->account->address_id;
+    client_push_submission(client, s);
+
+    if (!reactor->verifier || wpool_push(reactor->verifier, s))
+    {
+        submission_verify(s);
+        s->done = true;
+        client_drain_submissions(client);
+    }
+}
 
-    if (BN_cmp(hd, bd) >= 0)
-    {
-        /* Yay! Mined a block so submit to network */
-        log_info("+++ MINED A BLOCK +++ "
-                 "address=%.12s, round=%"PRIu64", diff=%"PRIu64", "
-                 "height=%"PRIu64,
-                 client->address,
-                 pool_stats.round_hashes + job->target,
-                 pool_stats.network_difficulty,
-                 pool_stats.network_height);
-        char *block_hex = calloc((bt->block_blob_size << 1)+1, sizeof(char));
-        bin_to_hex(block, bt->block_blob_size, block_hex);
-        char body[RPC_BODY_MAX] = {0};
-        snprintf(body, RPC_BODY_MAX,
-                "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":"
-                "\"submit_block\", \"params\":[\"%s\"]}",
-                block_hex);
+static int
+miner_on_message(struct bufferevent *bev, client_t *client,
+        const stratum_msg_t *msg, json_object *message)
+{
+    const char *unknown_method = "Removing client. Unknown method called.";
+    const char *too_bad = "Removing client. Too many bad shares.";
+    struct evbuffer *input = bufferevent_get_input(bev);
+    struct evbuffer *output = bufferevent_get_output(bev);
 
-        rpc_callback_t *cb = rpc_callback_new(rpc_on_block_submitted, 0, 0);
-        cb->data = calloc(1, sizeof(block_t));
-        block_t* b = (block_t*) cb->data;
-        b->height = bt->height;
-        unsigned char block_hash[32] = {0};
-        if (get_block_hash(block, bt->block_blob_size, block_hash))
-            log_error("Error getting block hash!");
-        bin_to_hex(block_hash, 32, b->hash);
-        strncpy(b->prev_hash, bt->prev_hash, 64);
-        b->difficulty = bt->difficulty;
-        b->status = BLOCK_LOCKED;
-        b->timestamp = now;
-        if (upstream_event)
-            upstream_send_client_block(b);
-        rpc_request(pool_base, body, cb);
-        free(block_hex);
+    client->json_id = msg->id;
+
+    bool unknown = false;
+
+    /* Login and block_template are only ever parsed by json-c */
+    switch (msg->method)
+    {
+        case STRATUM_LOGIN:
+            miner_on_login(message, client);
+            break;
+        case STRATUM_BLOCK_TEMPLATE:
+            miner_on_block_template(message, client);
+            break;
+        case STRATUM_SUBMIT:
+            miner_on_submit(msg, client);
+            break;
+        case STRATUM_GETJOB:
+            miner_send_job(client, false);
+            break;
+        case STRATUM_KEEPALIVED:
+        {
+            char body[STATUS_BODY_MAX] = {0};
+            stratum_get_status_body(body, client->json_id, "KEEPALIVED");
+            evbuffer_add(output, body, strlen(body));
+            break;
+        }
+        default:
+            unknown = true;
     }
-    else if (BN_cmp(hd, jd) < 0)
+
+    if (unknown)
     {
-        can_store = false;
         char body[ERROR_BODY_MAX] = {0};
-        stratum_get_error_body(body, client->json_id, "Low difficulty share");
+        stratum_get_error_body(body, client->json_id, unknown_method);
         evbuffer_add(output, body, strlen(body));
-        log_debug("Low difficulty (%lu) share", BN_get_word(jd));
-        client->bad_shares++;
+        log_warn("[%s:%d] %s", client->host, client->port, unknown_method);
+        evbuffer_drain(input, evbuffer_get_length(input));
+        client_clear(bev);
+        return -1;
     }
-
-    BN_free(hd);
-    BN_free(jd);
-    BN_free(bd);
-    free(block);
-    free(hashing_blob);
-
-    if (can_store)
+    if (client->bad_shares > MAX_BAD_SHARES)
     {
-        int rc = 0;
-        if (client->bad_shares)
-            client->bad_shares--;
-        share_t share = {0,0,{0},0};
-        share.height = bt->height;
-        share.difficulty = job->target;
-        strcpy(share.address, client->address);
-        share.timestamp = now;
-        if (!upstream_event)
-            pool_stats.round_hashes += share.difficulty;
-        log_debug("Storing share with difficulty: %"PRIu64, share.difficulty);
-        if ((rc = store_share(share.height, &share)))
-            log_warn("Failed to store share: %s", mdb_strerror(rc));
-        char body[STATUS_BODY_MAX] = {0};
-        stratum_get_status_body(body, client->json_id, "OK");
+        char body[ERROR_BODY_MAX] = {0};
+        stratum_get_error_body(body, client->json_id, too_bad);
         evbuffer_add(output, body, strlen(body));
-        if (upstream_event)
-            upstream_send_client_share(&share);
-    }
-    if (retarget_required(client, job))
-    {
-        log_debug("Sending an early job as this was less than %u%% of"
-                " potential", (unsigned)(100.*config.retarget_ratio));
-        miner_send_job(client, false);
+        log_warn("[%s:%d] %s", client->host, client->port, too_bad);
+        evbuffer_drain(input, evbuffer_get_length(input));
+        client_clear(bev);
+        return -1;
     }
+    return 0;
+}
+
+static const char *
+input_line(struct evbuffer *input, size_t n)
+{
+    /* Parse in place unless the line straddles chunks */
+    struct evbuffer_iovec v;
+    if (!n)
+        return "";
+    if (evbuffer_peek(input, n, NULL, &v, 1) == 1)
+        return (const char*) v.iov_base;
+    return (const char*) evbuffer_pullup(input, n);
 }
 
 static void
 miner_on_read(struct bufferevent *bev, void *ctx)
 {
-    const char *unknown_method = "Removing client. Unknown method called.";
-    const char *too_bad = "Removing client. Too many bad shares.";
     const char *too_long = "Removing client. Message too long.";
     const char *invalid_json = "Removing client. Invalid JSON.";
     struct evbuffer *input, *output;
-    char *line = NULL;
-    size_t n = 0;
     client_t *client = NULL;
 
     pthread_mutex_lock(&mutex_clients);
@@ -3618,93 +6278,133 @@ miner_on_read(struct bufferevent *bev, void *ctx)
     input = bufferevent_get_input(bev);
     output = bufferevent_get_output(bev);
 
-    size_t len = evbuffer_get_length(input);
-    if (len > MAX_LINE)
-    {
-        char body[ERROR_BODY_MAX] = {0};
-        stratum_get_error_body(body, client->json_id, too_long);
-        evbuffer_add(output, body, strlen(body));
-        log_warn("[%s:%d] %s", client->host, client->port, too_long);
-        evbuffer_drain(input, len);
-        client_clear(bev);
-        goto unlock;
-    }
-
-    while ((line = evbuffer_readln(input, &n, EVBUFFER_EOL_LF)))
+    while (client->pending_count < CLIENT_PENDING_MAX)
     {
-        json_object *message = json_tokener_parse(line);
-        if (!message)
-        {
-            free(line);
-            char body[ERROR_BODY_MAX] = {0};
-            stratum_get_error_body(body, client->json_id, invalid_json);
-            evbuffer_add(output, body, strlen(body));
-            log_warn("[%s:%d] %s", client->host, client->port, invalid_json);
-            evbuffer_drain(input, len);
-            client_clear(bev);
-            goto unlock;
-        }
-        JSON_GET_OR_WARN(method, message, json_type_string);
-        JSON_GET_OR_WARN(id, message, json_type_int);
-        const char *method_name = json_object_get_string(method);
-        client->json_id = json_object_get_int(id);
-
-        bool unknown = false;
-
-        if (!method || !method_name)
-        {
-            unknown = true;
-        }
-        else if (strcmp(method_name, "login") == 0)
-        {
-            miner_on_login(message, client);
-        }
-        else if (strcmp(method_name, "block_template") == 0)
-        {
-            miner_on_block_template(message, client);
-        }
-        else if (strcmp(method_name, "submit") == 0)
+        size_t eol_len = 0;
+        struct evbuffer_ptr eol = evbuffer_search_eol(input, NULL,
+                &eol_len, EVBUFFER_EOL_LF);
+        if (eol.pos < 0)
         {
-            miner_on_submit(message, client);
-        }
-        else if (strcmp(method_name, "getjob") == 0)
-        {
-            miner_send_job(client, false);
+            /*
+              Whole lines held back whilst shares are verified may fill the
+              buffer, but a single line that does is too long. The read
+              watermark stops the buffer growing past MAX_LINE.
+            */
+            size_t len = evbuffer_get_length(input);
+            if (len >= MAX_LINE)
+            {
+                char body[ERROR_BODY_MAX] = {0};
+                stratum_get_error_body(body, client->json_id, too_long);
+                evbuffer_add(output, body, strlen(body));
+                log_warn("[%s:%d] %s", client->host, client->port,
+                        too_long);
+                evbuffer_drain(input, len);
+                client_clear(bev);
+                goto unlock;
+            }
+            break;
         }
-        else if (strcmp(method_name, "keepalived") == 0)
+        size_t n = eol.pos;
+        const char *line = input_line(input, n);
+        json_object *message = NULL;
+        stratum_msg_t msg;
+        if (stratum_parse(line, n, &msg))
         {
-            char body[STATUS_BODY_MAX] = {0};
-            stratum_get_status_body(body, client->json_id, "KEEPALIVED");
-            evbuffer_add(output, body, strlen(body));
+            json_tokener *tok = json_tokener_new();
+            message = json_tokener_parse_ex(tok, line, n);
+            json_tokener_free(tok);
+            if (!message)
+            {
+                char body[ERROR_BODY_MAX] = {0};
+                stratum_get_error_body(body, client->json_id, invalid_json);
+                evbuffer_add(output, body, strlen(body));
+                log_warn("[%s:%d] %s", client->host, client->port,
+                        invalid_json);
+                evbuffer_drain(input, evbuffer_get_length(input));
+                client_clear(bev);
+                goto unlock;
+            }
+            stratum_from_json(message, &msg);
+            __atomic_add_fetch(&pool_metrics.messages_fallback, 1,
+                    __ATOMIC_RELAXED);
         }
         else
+            __atomic_add_fetch(&pool_metrics.messages_parsed, 1,
+                    __ATOMIC_RELAXED);
+
+        /*
+          Only submissions are pipelined whilst shares are being verified,
+          any other message stays in the buffer until every pending reply
+          has been sent.
+        */
+        if (client->pending && msg.method != STRATUM_SUBMIT)
         {
-            unknown = true;
+            if (message)
+                json_object_put(message);
+            break;
         }
+        evbuffer_drain(input, n + eol_len);
+        int rc = miner_on_message(bev, client, &msg, message);
+        if (message)
+            json_object_put(message);
+        if (rc)
+            goto unlock;
+    }
+unlock:
+    pthread_mutex_lock(&mutex_clients);
+    clients_reading--;
+    pthread_cond_signal(&cond_clients);
+    pthread_mutex_unlock(&mutex_clients);
+}
 
-        json_object_put(message);
-        free(line);
+static void
+submission_on_verified(void *item)
+{
+    const char *too_bad = "Removing client. Too many bad shares.";
+    submission_t *s = (submission_t*) item;
+    client_t *client = NULL;
 
-        if (unknown)
-        {
-            char body[ERROR_BODY_MAX] = {0};
-            stratum_get_error_body(body, client->json_id, unknown_method);
-            evbuffer_add(output, body, strlen(body));
-            log_warn("[%s:%d] %s", client->host, client->port, unknown_method);
-            evbuffer_drain(input, len);
-            client_clear(bev);
-            goto unlock;
-        }
-        if (client->bad_shares > MAX_BAD_SHARES)
-        {
-            char body[ERROR_BODY_MAX] = {0};
-            stratum_get_error_body(body, client->json_id, too_bad);
-            evbuffer_add(output, body, strlen(body));
-            log_warn("[%s:%d] %s", client->host, client->port, too_bad);
-            evbuffer_drain(input, len);
-            client_clear(bev);
-            goto unlock;
-        }
+    s->done = true;
+    if (s->orphaned)
+    {
+        submission_process(s, NULL);
+        submission_free(s);
+        return;
+    }
+
+    pthread_mutex_lock(&mutex_clients);
+    clients_reading++;
+    pthread_mutex_unlock(&mutex_clients);
+
+    pthread_rwlock_rdlock(&rwlock_cfd);
+    HASH_FIND_INT(clients_by_fd, &s->fd, client);
+    pthread_rwlock_unlock(&rwlock_cfd);
+    if (!client || client->serial != s->serial)
+    {
+        /* Clearing a client orphans its submissions, so never expected */
+        log_error("Verified share for unknown client");
+        submission_process(s, NULL);
+        submission_free(s);
+        goto unlock;
+    }
+
+    struct bufferevent *bev = client->bev;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    client_drain_submissions(client);
+    if (client->bad_shares > MAX_BAD_SHARES)
+    {
+        struct evbuffer *output = bufferevent_get_output(bev);
+        char body[ERROR_BODY_MAX] = {0};
+        stratum_get_error_body(body, client->json_id, too_bad);
+        evbuffer_add(output, body, strlen(body));
+        log_warn("[%s:%d] %s", client->host, client->port, too_bad);
+        evbuffer_drain(input, evbuffer_get_length(input));
+        client_clear(bev);
+    }
+    else if (evbuffer_get_length(input))
+    {
+        /* Resume anything held back whilst waiting on verification */
+        miner_on_read(bev, NULL);
     }
 unlock:
     pthread_mutex_lock(&mutex_clients);
@@ -3713,6 +6413,30 @@ unlock:
     pthread_mutex_unlock(&mutex_clients);
 }
 
+static void
+verifier_on_start(unsigned idx)
+{
+    if (!verify_nodes)
+        return;
+    unsigned seq = __atomic_fetch_add(&verifier_seq, 1, __ATOMIC_RELAXED);
+    unsigned node = seq % verify_nodes;
+    if (numa_pin(node))
+    {
+        log_warn("Cannot bind verifier thread %u to NUMA node %u",
+                seq, node);
+        return;
+    }
+    rx_thread_node(node);
+    verifier_node = node;
+    log_info("Verifier thread %u using NUMA node %u", seq, node);
+}
+
+static void
+verifier_on_stop(unsigned idx)
+{
+    rx_thread_free();
+}
+
 static void
 trusted_on_read(struct bufferevent *bev, void *ctx)
 {
@@ -3925,6 +6649,13 @@ read_config(const char *config_file)
     config.disable_payouts = false;
     strcpy(config.data_dir, "./data");
     config.cull_shares = -1;
+    config.verify_threads = 0;
+    config.verify_numa = false;
+    config.broadcast_threads = 0;
+    config.stratum_threads = 1;
+    config.rx_dataset_save = false;
+    config.share_commit_batch = 256;
+    config.share_commit_latency = 50;
 
     if (config_file)
     {
@@ -4114,6 +6845,34 @@ read_config(const char *config_file)
         {
             config.cull_shares = atoi(val);
         }
+        else if (strcmp(key, "verify-threads") == 0)
+        {
+            config.verify_threads = atoi(val);
+        }
+        else if (strcmp(key, "verify-numa") == 0)
+        {
+            config.verify_numa = atoi(val);
+        }
+        else if (strcmp(key, "broadcast-threads") == 0)
+        {
+            config.broadcast_threads = atoi(val);
+        }
+        else if (strcmp(key, "stratum-threads") == 0)
+        {
+            config.stratum_threads = atoi(val);
+        }
+        else if (strcmp(key, "rx-dataset-save") == 0)
+        {
+            config.rx_dataset_save = atoi(val);
+        }
+        else if (strcmp(key, "share-commit-batch") == 0)
+        {
+            config.share_commit_batch = atoi(val);
+        }
+        else if (strcmp(key, "share-commit-latency") == 0)
+        {
+            config.share_commit_latency = atoi(val);
+        }
         else if (strcmp(key, "trusted-listen") == 0)
         {
             strncpy(config.trusted_listen, val,
@@ -4189,6 +6948,11 @@ read_config(const char *config_file)
                 " work is less than retarget-ratio percentage of potential.");
         exit(-1);
     }
+    if (config.stratum_threads < 1)
+    {
+        log_warn("Stratum threads must be at least 1");
+        config.stratum_threads = 1;
+    }
     if (config.template_timeout < config.retarget_time)
     {
         log_warn("Block template timeout below job retargeting time");
@@ -4263,6 +7027,13 @@ print_config(void)
         "  forked = %u\n"
         "  processes = %d\n"
         "  cull-shares = %d\n"
+        "  verify-threads = %u\n"
+        "  verify-numa = %u\n"
+        "  broadcast-threads = %u\n"
+        "  stratum-threads = %u\n"
+        "  rx-dataset-save = %u\n"
+        "  share-commit-batch = %u\n"
+        "  share-commit-latency = %u\n"
         "  trusted-listen = %s\n"
         "  trusted-port = %u\n"
         "  trusted-allowed = %s\n"
@@ -4302,6 +7073,13 @@ print_config(void)
         config.forked,
         config.processes,
         config.cull_shares,
+        config.verify_threads,
+        config.verify_numa,
+        config.broadcast_threads,
+        config.stratum_threads,
+        config.rx_dataset_save,
+        config.share_commit_batch,
+        config.share_commit_latency,
         config.trusted_listen,
         config.trusted_port,
         display_allowed,
@@ -4309,6 +7087,12 @@ print_config(void)
         config.upstream_port);
 }
 
+static void
+timer_on_shares(int fd, short kind, void *ctx)
+{
+    flush_shares();
+}
+
 static void
 sigusr1_handler(evutil_socket_t fd, short event, void *arg)
 {
@@ -4389,26 +7173,19 @@ bail:
     return 0;
 }
 
-static void
-run(void)
+static evutil_socket_t
+listener_new(const char *host, uint16_t port_num)
 {
     evutil_socket_t listener;
     struct addrinfo *info = NULL;
     int rc = 0;
     char port[6] = {0};
 
-    pool_base = event_base_new();
-    if (!pool_base)
-    {
-        log_fatal("Failed to create event base");
-        return;
-    }
-
-    sprintf(port, "%d", config.pool_port);
-    if ((rc = getaddrinfo(config.pool_listen, port, 0, &info)))
+    sprintf(port, "%d", port_num);
+    if ((rc = getaddrinfo(host, port, 0, &info)))
     {
         log_fatal("Error parsing listen address: %s", gai_strerror(rc));
-        return;
+        return -1;
     }
 
     listener = socket(info->ai_family, SOCK_STREAM, 0);
@@ -4436,18 +7213,189 @@ run(void)
         perror("listen");
         goto bail;
     }
+    return listener;
+
+bail:
+    if (info)
+        freeaddrinfo(info);
+    evutil_closesocket(listener);
+    return -1;
+}
+
+static void *
+reactor_run(void *ctx)
+{
+    reactor = (reactor_t*) ctx;
+    event_base_dispatch(reactor->base);
+    rx_thread_free();
+    return 0;
+}
+
+static int
+reactor_start(reactor_t *r)
+{
+    /*
+      Each stratum thread has its own listener on the pool port (relying on
+      SO_REUSEPORT to spread connections), event base, clients and worker
+      pools. The first runs on the main thread, sharing its event base.
+    */
+    evutil_socket_t listener = listener_new(config.pool_listen,
+            config.pool_port);
+    if (listener < 0)
+        return -1;
+
+    r->base = r->idx ? event_base_new() : pool_base;
+    if (!r->base)
+    {
+        log_fatal("Failed to create event base");
+        evutil_closesocket(listener);
+        return -1;
+    }
 
-    listener_event = event_new(pool_base, listener, EV_READ|EV_PERSIST,
-            listener_on_accept, (void*)pool_base);
-    if (event_add(listener_event, NULL))
+    r->listener_event = event_new(r->base, listener, EV_READ|EV_PERSIST,
+            listener_on_accept, (void*)r->base);
+    if (event_add(r->listener_event, NULL))
     {
         log_fatal("Failed to add socket listener event");
-        goto bail;
+        return -1;
+    }
+    r->send_jobs = event_new(r->base, -1, 0, reactor_on_send_jobs, NULL);
+
+    slab_new(&r->slab_submissions, sizeof(submission_t), SUBMISSIONS_SLAB);
+    slab_new(&r->slab_broadcast, sizeof(job_send_t), BROADCAST_SLAB);
+
+    if (config.verify_threads
+            && wpool_new(&r->verifier, r->base, config.verify_threads,
+                VERIFY_QUEUE_MAX, submission_verify,
+                submission_on_verified, verifier_on_start,
+                verifier_on_stop))
+    {
+        log_fatal("Cannot create verification threads");
+        return -1;
+    }
+
+    if (!config.disable_self_select
+            && wpool_new(&r->validator, r->base, 1, VALIDATE_QUEUE_MAX,
+                template_validate, submission_on_verified, NULL, NULL))
+    {
+        log_fatal("Cannot create template validation thread");
+        return -1;
+    }
+
+    if (config.broadcast_threads
+            && wpool_new(&r->broadcaster, r->base, config.broadcast_threads,
+                BROADCAST_QUEUE_MAX, broadcast_build,
+                broadcast_on_built, NULL, NULL))
+    {
+        log_fatal("Cannot create broadcast threads");
+        return -1;
+    }
+
+    if (r->idx && pthread_create(&r->thread, NULL, reactor_run, r))
+    {
+        log_fatal("Cannot create stratum thread");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+reactors_stop(void)
+{
+    if (!reactors)
+        return;
+    for (unsigned i=1; i<config.stratum_threads; i++)
+    {
+        reactor_t *r = &reactors[i];
+        if (!r->thread)
+            continue;
+        event_base_loopbreak(r->base);
+        pthread_join(r->thread, NULL);
+    }
+    for (unsigned i=0; i<config.stratum_threads; i++)
+    {
+        reactor_t *r = &reactors[i];
+        if (r->verifier)
+            wpool_free(r->verifier);
+        if (r->broadcaster)
+            wpool_free(r->broadcaster);
+        if (r->validator)
+            wpool_free(r->validator);
+        if (r->listener_event)
+            event_free(r->listener_event);
+        if (r->send_jobs)
+            event_free(r->send_jobs);
+        if (r->idx && r->base)
+            event_base_free(r->base);
+    }
+}
+
+static void
+reactors_free(void)
+{
+    if (!reactors)
+        return;
+    for (unsigned i=0; i<config.stratum_threads; i++)
+    {
+        reactor_t *r = &reactors[i];
+        if (r->slab_submissions)
+            slab_free(r->slab_submissions);
+        if (r->slab_broadcast)
+            slab_free(r->slab_broadcast);
+        free(r->broadcast_ranks);
+    }
+    free(reactors);
+    reactors = NULL;
+}
+
+static void
+run(void)
+{
+    sigset_t set, old;
+
+    pool_base = event_base_new();
+    if (!pool_base)
+    {
+        log_fatal("Failed to create event base");
+        return;
+    }
+
+    if (config.verify_threads)
+        log_info("Starting share verification threads: %u per stratum "
+                "thread", config.verify_threads);
+    if (config.broadcast_threads)
+        log_info("Starting job broadcast threads: %u per stratum thread",
+                config.broadcast_threads);
+    log_info("Starting stratum threads: %u", config.stratum_threads);
+
+    /* Signals are left to the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    reactors = calloc(config.stratum_threads, sizeof(reactor_t));
+    reactor = &reactors[0];
+    for (unsigned i=0; i<config.stratum_threads; i++)
+    {
+        reactors[i].idx = i;
+        if (reactor_start(&reactors[i]))
+        {
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            return;
+        }
     }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 
     signal_usr1 = evsignal_new(pool_base, SIGUSR1, sigusr1_handler, NULL);
     event_add(signal_usr1, NULL);
 
+    if (config.share_commit_latency)
+    {
+        struct timeval tv = {config.share_commit_latency / 1000,
+            (config.share_commit_latency % 1000) * 1000};
+        timer_shares = event_new(pool_base, -1, EV_PERSIST,
+                timer_on_shares, NULL);
+        event_add(timer_shares, &tv);
+    }
+
     if (*config.trusted_listen && config.trusted_port)
     {
         log_info("Starting trusted listener on: %s:%d",
@@ -4455,7 +7403,7 @@ run(void)
         if (pthread_create(&trusted_th, NULL, trusted_run, NULL))
         {
             log_fatal("Cannot create trusted thread");
-            goto bail;
+            return;
         }
         pthread_detach(trusted_th);
     }
@@ -4474,10 +7422,24 @@ run(void)
 
     if (abattoir)
     {
+        timer_cull = evtimer_new(pool_base, timer_on_cull, NULL);
         timer_10m = evtimer_new(pool_base, timer_on_10m, NULL);
         timer_on_10m(-1, EV_TIMEOUT, NULL);
     }
 
+    {
+        struct timeval tv = {CHECKPOINT_INTERVAL, 0};
+        timer_checkpoint = event_new(pool_base, -1, EV_PERSIST,
+                timer_on_checkpoint, NULL);
+        event_add(timer_checkpoint, &tv);
+    }
+
+    if (abattoir && migrating)
+    {
+        timer_migrate = evtimer_new(pool_base, timer_on_migrate, NULL);
+        timer_on_migrate(-1, EV_TIMEOUT, NULL);
+    }
+
     if (*config.upstream_host)
     {
         timer_10s = evtimer_new(pool_base, timer_on_10s, NULL);
@@ -4486,10 +7448,6 @@ run(void)
     }
 
     event_base_dispatch(pool_base);
-
-bail:
-    if (info)
-        freeaddrinfo(info);
 }
 
 static void
@@ -4502,10 +7460,16 @@ cleanup(void)
         event_free(timer_30s);
     if (timer_10m)
         event_free(timer_10m);
+    if (timer_migrate)
+        event_free(timer_migrate);
+    if (timer_cull)
+        event_free(timer_cull);
+    if (timer_checkpoint)
+        event_free(timer_checkpoint);
     if (timer_template)
         event_free(timer_template);
-    if (listener_event)
-        event_free(listener_event);
+    if (timer_shares)
+        event_free(timer_shares);
     if (trusted_event)
         event_free(trusted_event);
     if (upstream_event)
@@ -4516,22 +7480,34 @@ cleanup(void)
         event_free(signal_usr1);
     if (trusted_base)
         event_base_loopbreak(trusted_base);
+    reactors_stop();
     if (pool_base)
         event_base_free(pool_base);
+    if (timer_checkpoint)
+    {
+        accounts_checkpoint();
+        if (abattoir)
+            round_checkpoint();
+    }
     clients_free();
+    reactors_free();
     if (bsh)
         bstack_free(bsh);
     if (bst)
         bstack_free(bst);
+    flush_shares();
+    free(share_buffer);
+    free(share_spare);
     database_close();
-    BN_free(base_diff);
-    BN_CTX_free(bn_ctx);
-    rx_slow_hash_free_state();
+    rx_free();
     pthread_mutex_destroy(&mutex_clients);
     pthread_mutex_destroy(&mutex_log);
+    pthread_mutex_destroy(&mutex_shares);
+    pthread_mutex_destroy(&mutex_share_commit);
     pthread_rwlock_destroy(&rwlock_tx);
     pthread_rwlock_destroy(&rwlock_acc);
     pthread_rwlock_destroy(&rwlock_cfd);
+    pthread_rwlock_destroy(&rwlock_tpl);
     pthread_cond_destroy(&cond_clients);
     log_info("Pool shutdown successfully");
     if (fd_log)
@@ -4573,6 +7549,7 @@ int main(int argc, char **argv)
     int forked = -1;
     int processes = 1;
     int c;
+    started_us = monotonic_us();
     while (1)
     {
         int option_index = 0;
@@ -4717,6 +7694,7 @@ int main(int argc, char **argv)
 
     log_set_udata(&mutex_log);
     log_set_lock(log_lock);
+    evthread_use_pthreads();
     signal(SIGINT, sigint_handler);
     signal(SIGTERM, sigint_handler);
     signal(SIGPIPE, SIG_IGN);
@@ -4733,22 +7711,33 @@ int main(int argc, char **argv)
             template_recycle);
     bstack_new(&bsh, BLOCK_HEADERS_MAX, sizeof(block_t), NULL);
 
-    bn_ctx = BN_CTX_new();
-    base_diff = NULL;
-    BN_hex2bn(&base_diff,
-        "FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF");
-
     uuid_t iid;
     uuid_generate(iid);
     memcpy(&instance_id, iid, 4);
 
     clients_init();
+    rx_init(getenv("MONERO_RANDOMX_FULL_MEM") != NULL,
+            sysconf(_SC_NPROCESSORS_ONLN),
+            config.rx_dataset_save ? config.data_dir : NULL,
+            config.processes != 1);
+    if (config.verify_numa && config.verify_threads)
+    {
+        verify_nodes = numa_nodes();
+        if (verify_nodes > VERIFY_NODES_MAX)
+            verify_nodes = VERIFY_NODES_MAX;
+        log_info("NUMA nodes for share verification: %u", verify_nodes);
+        if (verify_nodes < 2)
+            verify_nodes = 0;
+        else
+            rx_numa(verify_nodes);
+    }
 
     wui_context_t uic;
     memset(&uic, 0, sizeof(wui_context_t));
     strcpy(uic.listen, config.webui_listen);
     uic.port = config.webui_port;
     uic.pool_stats = &pool_stats;
+    uic.pool_metrics = &pool_metrics;
     uic.pool_fee = config.pool_fee;
     uic.pool_port = config.pool_port;
     uic.pool_ssl_port = config.pool_ssl_port;
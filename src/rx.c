@@ -0,0 +1,878 @@
+/*
+Copyright (c) 2018, The Monero Project
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Each seed hash gets a slot holding its cache (and dataset in full memory
+  mode). A builder thread initializes queued slots, so the next epoch's seed
+  is ready before the switch, and a replaced seed stays usable for
+  RX_GRACE seconds so late shares on it verify without a rebuild. VMs are
+  per thread and per slot, and are re-pointed when their slot is reused.
+
+  When given a directory, full memory datasets are also saved there once
+  built, and mapped back in (rather than recomputed) if a file for the
+  seed already exists, such as after a restart.
+
+  With several pool processes, full memory datasets are instead built once
+  into a file under RX_SHM_DIR, by whichever process gets its lock first,
+  and every process maps that same file.
+
+  With NUMA enabled (and a single process), each other node also gets its
+  own copy of a full memory dataset when it has the memory free, and VMs
+  on threads bound to a node hash against that node's copy.
+*/
+
+#include "randomx/src/randomx.h"
+#include "rx.h"
+#include "log.h"
+#include "util.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define RX_SLOTS 3
+#define RX_GRACE 600
+#define DATASET_MAGIC "RXDATA01"
+#define DATASET_OFFSET 4096
+#define RX_SHM_DIR "/dev/shm"
+#define REPLICA_SLACK_KB (512 * 1024)
+
+enum rx_state
+{
+    RX_EMPTY,
+    RX_QUEUED,
+    RX_BUILDING,
+    RX_READY
+};
+
+typedef struct rx_slot_t
+{
+    unsigned char seed[32];
+    int state;
+    randomx_cache *cache;
+    randomx_dataset *dataset;
+    bool mapped;
+    randomx_dataset *replica[NUMA_NODES_MAX];
+    uint64_t gen;
+    unsigned refs;
+    time_t retired;
+} rx_slot_t;
+
+typedef struct dataset_part_t
+{
+    randomx_dataset *dataset;
+    randomx_cache *cache;
+    unsigned long start;
+    unsigned long count;
+} dataset_part_t;
+
+typedef struct replica_job_t
+{
+    randomx_dataset *source;
+    randomx_dataset *replica;
+    unsigned node;
+} replica_job_t;
+
+typedef struct dataset_head_t
+{
+    char magic[8];
+    unsigned char seed[32];
+    uint64_t size;
+} dataset_head_t;
+
+/*
+  Same layout as librandomx's randomx_dataset, so a dataset can sit on a
+  mapping of ours. These are unmapped here and never handed to
+  randomx_release_dataset. The library does not export the struct, so
+  dataset_layout_ok checks the assumption before any are made.
+*/
+typedef struct mapped_dataset_t
+{
+    uint8_t *memory;
+    void *dealloc;
+} mapped_dataset_t;
+
+static rx_slot_t slots[RX_SLOTS];
+static rx_slot_t *current;
+static uint64_t gen_last;
+static bool running;
+static bool full_mem;
+static unsigned init_threads;
+static char dataset_dir[PATH_MAX];
+static bool shared;
+static unsigned numa_count;
+static randomx_flags flags;
+static pthread_t builder;
+static pthread_mutex_t mutex_rx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cond_queued = PTHREAD_COND_INITIALIZER;
+
+static bool vm_small_pages;
+
+static __thread randomx_vm *vms[RX_SLOTS];
+static __thread uint64_t vm_gens[RX_SLOTS];
+static __thread bool vm_full[RX_SLOTS];
+static __thread int vm_node = -1;
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *
+dataset_init_part(void *ctx)
+{
+    dataset_part_t *part = (dataset_part_t*) ctx;
+    randomx_init_dataset(part->dataset, part->cache, part->start,
+            part->count);
+    return NULL;
+}
+
+static void
+dataset_init(randomx_dataset *dataset, randomx_cache *cache)
+{
+    unsigned long items = randomx_dataset_item_count();
+    unsigned n = init_threads ? init_threads : 1;
+    dataset_part_t *parts = calloc(n, sizeof(dataset_part_t));
+    pthread_t *th = calloc(n, sizeof(pthread_t));
+    bool *started = calloc(n, sizeof(bool));
+    unsigned long per = items / n;
+    for (unsigned i=0; i<n; i++)
+    {
+        dataset_part_t *part = &parts[i];
+        part->dataset = dataset;
+        part->cache = cache;
+        part->start = i * per;
+        part->count = i < n-1 ? per : items - part->start;
+        if (i < n-1)
+            started[i] = !pthread_create(&th[i], NULL,
+                    dataset_init_part, part);
+        if (!started[i])
+            dataset_init_part(part);
+    }
+    for (unsigned i=0; i<n; i++)
+        if (started[i])
+            pthread_join(th[i], NULL);
+    free(started);
+    free(th);
+    free(parts);
+}
+
+static size_t
+dataset_size(void)
+{
+    return randomx_dataset_item_count() * RANDOMX_DATASET_ITEM_SIZE;
+}
+
+static void
+dataset_path(const unsigned char *seed, char *path)
+{
+    char hex[65] = {0};
+    bin_to_hex(seed, 32, hex);
+    snprintf(path, PATH_MAX, "%s/randomx-%s.dataset", dataset_dir, hex);
+}
+
+static void
+dataset_unmap(randomx_dataset *dataset)
+{
+    mapped_dataset_t *md = (mapped_dataset_t*) dataset;
+    munmap(md->memory, dataset_size());
+    free(md);
+}
+
+static void
+shared_path(const unsigned char *seed, char *path)
+{
+    char hex[65] = {0};
+    bin_to_hex(seed, 32, hex);
+    snprintf(path, PATH_MAX, "%s/monero-pool-rx-%s", RX_SHM_DIR, hex);
+}
+
+static void
+dataset_forget(const unsigned char *seed)
+{
+    char path[PATH_MAX];
+    if (dataset_dir[0])
+    {
+        dataset_path(seed, path);
+        unlink(path);
+    }
+    if (shared)
+    {
+        shared_path(seed, path);
+        unlink(path);
+    }
+}
+
+static bool
+dataset_layout_ok(void)
+{
+    /*
+      Reads the memory pointer back through the library. The padding keeps
+      the read in bounds should the real struct have grown.
+    */
+    union
+    {
+        mapped_dataset_t md;
+        uint8_t pad[256];
+    } probe;
+    uint8_t mark;
+    memset(&probe, 0, sizeof(probe));
+    probe.md.memory = &mark;
+    return randomx_get_dataset_memory((randomx_dataset*) &probe) == &mark;
+}
+
+static randomx_dataset *
+dataset_map(int fd, const unsigned char *seed)
+{
+    /* Maps a complete dataset file read-only, else returns NULL */
+    dataset_head_t head;
+    struct stat st;
+    size_t size = dataset_size();
+    mapped_dataset_t *md = NULL;
+
+    if (pread(fd, &head, sizeof(head), 0) != sizeof(head)
+            || memcmp(head.magic, DATASET_MAGIC, 8)
+            || memcmp(head.seed, seed, 32) || head.size != size
+            || fstat(fd, &st) || (size_t)st.st_size < DATASET_OFFSET + size)
+        return NULL;
+    void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd,
+            DATASET_OFFSET);
+    if (mem == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(mem, size, MADV_HUGEPAGE);
+#endif
+    md = calloc(1, sizeof(mapped_dataset_t));
+    md->memory = mem;
+    return (randomx_dataset*) md;
+}
+
+static randomx_dataset *
+dataset_load(const unsigned char *seed)
+{
+    char path[PATH_MAX];
+    dataset_path(seed, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    randomx_dataset *dataset = dataset_map(fd, seed);
+    if (!dataset)
+        log_warn("Ignoring unusable RandomX dataset file: %s", path);
+    close(fd);
+    return dataset;
+}
+
+static void
+dataset_save(const unsigned char *seed, randomx_dataset *dataset)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX+16];
+    char page[DATASET_OFFSET] = {0};
+    dataset_head_t *head = (dataset_head_t*) page;
+    size_t size = dataset_size();
+    const char *mem = randomx_get_dataset_memory(dataset);
+    size_t done = 0;
+
+    dataset_path(seed, path);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        log_warn("Cannot create RandomX dataset file: %s", tmp);
+        return;
+    }
+    memcpy(head->magic, DATASET_MAGIC, 8);
+    memcpy(head->seed, seed, 32);
+    head->size = size;
+    if (write(fd, page, DATASET_OFFSET) != DATASET_OFFSET)
+        goto bail;
+    while (done < size)
+    {
+        ssize_t w = write(fd, mem + done, size - done);
+        if (w <= 0)
+            goto bail;
+        done += w;
+    }
+    if (fsync(fd) || close(fd))
+    {
+        fd = -1;
+        goto bail;
+    }
+    if (rename(tmp, path))
+    {
+        fd = -1;
+        goto bail;
+    }
+    log_info("Saved RandomX dataset: %s", path);
+    return;
+bail:
+    log_warn("Failed writing RandomX dataset file: %s", tmp);
+    if (fd > -1)
+        close(fd);
+    unlink(tmp);
+}
+
+static bool
+cache_init(rx_slot_t *slot, const char *hex)
+{
+    if (!slot->cache)
+    {
+        slot->cache = randomx_alloc_cache(flags | RANDOMX_FLAG_LARGE_PAGES);
+        if (!slot->cache)
+            slot->cache = randomx_alloc_cache(flags);
+    }
+    if (!slot->cache)
+    {
+        log_error("Cannot allocate RandomX cache for seed: %.16s", hex);
+        return false;
+    }
+    randomx_init_cache(slot->cache, slot->seed, 32);
+    return true;
+}
+
+static randomx_dataset *
+dataset_shared(rx_slot_t *slot, const char *hex)
+{
+    /*
+      The file lock is held whilst building, so other processes wanting
+      the same seed wait here and then map the finished file.
+    */
+    char path[PATH_MAX];
+    size_t size = dataset_size();
+    randomx_dataset *dataset = NULL;
+    mapped_dataset_t *md = NULL;
+    dataset_head_t head;
+    void *mem = MAP_FAILED;
+
+    shared_path(slot->seed, path);
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        log_warn("Cannot open shared RandomX dataset: %s", path);
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX))
+        goto bail;
+    if ((dataset = dataset_map(fd, slot->seed)))
+        goto bail;
+    if (!cache_init(slot, hex))
+        goto bail;
+    if (ftruncate(fd, DATASET_OFFSET + size))
+        goto bail;
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+            DATASET_OFFSET);
+    if (mem == MAP_FAILED)
+        goto bail;
+#ifdef MADV_HUGEPAGE
+    madvise(mem, size, MADV_HUGEPAGE);
+#endif
+    md = calloc(1, sizeof(mapped_dataset_t));
+    md->memory = mem;
+    dataset = (randomx_dataset*) md;
+    dataset_init(dataset, slot->cache);
+    mprotect(mem, size, PROT_READ);
+
+    /* Only a complete file gets a header */
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, DATASET_MAGIC, 8);
+    memcpy(head.seed, slot->seed, 32);
+    head.size = size;
+    if (pwrite(fd, &head, sizeof(head), 0) != sizeof(head))
+        log_warn("Failed writing shared RandomX dataset: %s", path);
+    if (dataset_dir[0])
+        dataset_save(slot->seed, dataset);
+bail:
+    if (!dataset)
+        log_warn("Cannot share RandomX dataset: %s", path);
+    close(fd);
+    return dataset;
+}
+
+static void
+replicas_release(rx_slot_t *slot)
+{
+    for (unsigned i=0; i<NUMA_NODES_MAX; i++)
+    {
+        if (slot->replica[i])
+            randomx_release_dataset(slot->replica[i]);
+        slot->replica[i] = NULL;
+    }
+}
+
+static int
+dataset_home(randomx_dataset *dataset)
+{
+    /* The node holding every sampled page of the dataset, else -1 */
+    const char *mem = randomx_get_dataset_memory(dataset);
+    size_t step = dataset_size() / 16;
+    int home = -1;
+    for (unsigned i=0; i<16; i++)
+    {
+        int node = numa_node_of(mem + step * i);
+        if (node < 0 || (i && node != home))
+            return -1;
+        home = node;
+    }
+    return home;
+}
+
+static void *
+replica_build(void *ctx)
+{
+    /* Runs bound to the node, so the copy's pages are allocated there */
+    replica_job_t *job = (replica_job_t*) ctx;
+    size_t size = dataset_size();
+    if (numa_pin(job->node))
+        return NULL;
+    if (numa_free_kb(job->node) < size / 1024 + REPLICA_SLACK_KB)
+    {
+        log_info("Not enough memory on NUMA node %u for a RandomX dataset "
+                "replica", job->node);
+        return NULL;
+    }
+    randomx_dataset *dataset = randomx_alloc_dataset(
+            flags | RANDOMX_FLAG_LARGE_PAGES);
+    if (!dataset)
+        dataset = randomx_alloc_dataset(flags);
+    if (!dataset)
+        return NULL;
+    memcpy(randomx_get_dataset_memory(dataset),
+            randomx_get_dataset_memory(job->source), size);
+    job->replica = dataset;
+    return NULL;
+}
+
+static void
+replicas_build(rx_slot_t *slot)
+{
+    replica_job_t jobs[NUMA_NODES_MAX];
+    pthread_t th[NUMA_NODES_MAX];
+    bool started[NUMA_NODES_MAX] = {0};
+    unsigned count = 0;
+    uint64_t start = now_ms();
+
+    if (numa_count < 2 || shared || !slot->dataset)
+        return;
+    int home = dataset_home(slot->dataset);
+    for (unsigned i=0; i<numa_count; i++)
+    {
+        if ((int)i == home)
+            continue;
+        jobs[i].source = slot->dataset;
+        jobs[i].replica = NULL;
+        jobs[i].node = i;
+        started[i] = !pthread_create(&th[i], NULL, replica_build, &jobs[i]);
+    }
+    for (unsigned i=0; i<numa_count; i++)
+    {
+        if (!started[i])
+            continue;
+        pthread_join(th[i], NULL);
+        if ((slot->replica[i] = jobs[i].replica))
+            count++;
+    }
+    log_info("RandomX dataset replicas: %u (home node: %d) in %"PRIu64"ms",
+            count, home, now_ms() - start);
+}
+
+static void
+slot_build(rx_slot_t *slot)
+{
+    /* Runs on the builder thread, which owns the slot whilst building */
+    char hex[65] = {0};
+    uint64_t start = now_ms();
+    randomx_dataset *mapped = NULL;
+    bin_to_hex(slot->seed, 32, hex);
+    replicas_release(slot);
+    if (slot->mapped)
+    {
+        dataset_unmap(slot->dataset);
+        slot->dataset = NULL;
+        slot->mapped = false;
+    }
+    if (full_mem && dataset_dir[0])
+        mapped = dataset_load(slot->seed);
+    if (full_mem && shared && !mapped)
+        mapped = dataset_shared(slot, hex);
+    if (mapped)
+    {
+        /* The cache is only needed to compute a dataset */
+        if (slot->dataset)
+            randomx_release_dataset(slot->dataset);
+        if (slot->cache)
+            randomx_release_cache(slot->cache);
+        slot->cache = NULL;
+        slot->dataset = mapped;
+        slot->mapped = true;
+        log_info("RandomX seed %.16s mapped in %"PRIu64"ms", hex,
+                now_ms() - start);
+        return;
+    }
+    if (!cache_init(slot, hex))
+        return;
+    if (full_mem)
+    {
+        if (!slot->dataset)
+        {
+            slot->dataset = randomx_alloc_dataset(
+                    flags | RANDOMX_FLAG_LARGE_PAGES);
+            if (!slot->dataset)
+                slot->dataset = randomx_alloc_dataset(flags);
+        }
+        if (slot->dataset)
+        {
+            dataset_init(slot->dataset, slot->cache);
+            if (dataset_dir[0])
+                dataset_save(slot->seed, slot->dataset);
+        }
+        else
+            log_warn("Cannot allocate RandomX dataset for seed: %.16s; "
+                    "using light mode", hex);
+    }
+    log_info("RandomX seed %.16s ready in %"PRIu64"ms", hex,
+            now_ms() - start);
+}
+
+static void
+slot_release(rx_slot_t *slot)
+{
+    replicas_release(slot);
+    if (slot->mapped)
+        dataset_unmap(slot->dataset);
+    else if (slot->dataset)
+        randomx_release_dataset(slot->dataset);
+    if (slot->cache)
+        randomx_release_cache(slot->cache);
+    memset(slot, 0, sizeof(rx_slot_t));
+}
+
+static rx_slot_t *
+slot_find(const unsigned char *seed)
+{
+    for (unsigned i=0; i<RX_SLOTS; i++)
+    {
+        rx_slot_t *slot = &slots[i];
+        if (slot->state != RX_EMPTY && !memcmp(slot->seed, seed, 32))
+            return slot;
+    }
+    return NULL;
+}
+
+static rx_slot_t *
+slot_claim(void)
+{
+    /* An empty slot, else the longest retired one nobody is hashing on */
+    rx_slot_t *pick = NULL;
+    for (unsigned i=0; i<RX_SLOTS; i++)
+    {
+        rx_slot_t *slot = &slots[i];
+        if (slot->state == RX_EMPTY)
+            return slot;
+        if (slot == current || slot->state != RX_READY
+                || !slot->retired || slot->refs)
+            continue;
+        if (!pick || slot->retired < pick->retired)
+            pick = slot;
+    }
+    return pick;
+}
+
+static void
+slot_queue(rx_slot_t *slot, const unsigned char *seed)
+{
+    if (slot->state != RX_EMPTY)
+        dataset_forget(slot->seed);
+    memcpy(slot->seed, seed, 32);
+    slot->state = RX_QUEUED;
+    slot->gen = ++gen_last;
+    slot->retired = 0;
+    pthread_cond_signal(&cond_queued);
+}
+
+static rx_slot_t *
+slot_queued(void)
+{
+    if (current && current->state == RX_QUEUED)
+        return current;
+    for (unsigned i=0; i<RX_SLOTS; i++)
+        if (slots[i].state == RX_QUEUED)
+            return &slots[i];
+    return NULL;
+}
+
+static void *
+builder_run(void *ctx)
+{
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&mutex_rx);
+    while (running)
+    {
+        rx_slot_t *slot = slot_queued();
+        if (!slot)
+        {
+            pthread_cond_wait(&cond_queued, &mutex_rx);
+            continue;
+        }
+        slot->state = RX_BUILDING;
+        pthread_mutex_unlock(&mutex_rx);
+        slot_build(slot);
+        replicas_build(slot);
+        pthread_mutex_lock(&mutex_rx);
+        slot->state = RX_READY;
+        pthread_cond_broadcast(&cond_ready);
+    }
+    pthread_mutex_unlock(&mutex_rx);
+    return NULL;
+}
+
+void
+rx_init(bool full, unsigned threads, const char *save_dir, bool share)
+{
+    full_mem = full;
+    shared = share;
+    init_threads = threads;
+    if (save_dir)
+        strncpy(dataset_dir, save_dir, sizeof(dataset_dir)-1);
+    if (full_mem && (dataset_dir[0] || shared) && !dataset_layout_ok())
+    {
+        log_warn("RandomX dataset layout not as expected; "
+                "datasets will not be saved or shared");
+        dataset_dir[0] = 0;
+        shared = false;
+    }
+    flags = randomx_get_flags();
+    running = true;
+    if (pthread_create(&builder, NULL, builder_run, NULL))
+    {
+        log_fatal("Cannot start RandomX builder thread");
+        abort();
+    }
+}
+
+void
+rx_numa(unsigned nodes)
+{
+    numa_count = nodes < NUMA_NODES_MAX ? nodes : NUMA_NODES_MAX;
+}
+
+void
+rx_thread_node(unsigned node)
+{
+    if (node < numa_count)
+        vm_node = node;
+}
+
+void
+rx_free(void)
+{
+    pthread_mutex_lock(&mutex_rx);
+    if (!running)
+    {
+        pthread_mutex_unlock(&mutex_rx);
+        return;
+    }
+    running = false;
+    pthread_cond_signal(&cond_queued);
+    pthread_mutex_unlock(&mutex_rx);
+    pthread_join(builder, NULL);
+    rx_thread_free();
+    for (unsigned i=0; i<RX_SLOTS; i++)
+    {
+        rx_slot_t *slot = &slots[i];
+        char path[PATH_MAX];
+        if (shared && slot->state != RX_EMPTY)
+        {
+            /* Processes still mapping it keep their pages */
+            shared_path(slot->seed, path);
+            unlink(path);
+        }
+        slot_release(slot);
+    }
+    current = NULL;
+}
+
+void
+rx_seed_set(const unsigned char *seed_hash,
+        const unsigned char *next_seed_hash)
+{
+    char hex[65] = {0};
+    time_t now = time(NULL);
+    rx_slot_t *next = NULL;
+
+    pthread_mutex_lock(&mutex_rx);
+    rx_slot_t *slot = slot_find(seed_hash);
+    if (!slot)
+    {
+        slot = slot_claim();
+        if (!slot)
+        {
+            bin_to_hex(seed_hash, 32, hex);
+            log_error("No RandomX slot free for seed: %.16s", hex);
+            goto unlock;
+        }
+        slot_queue(slot, seed_hash);
+    }
+    if (slot != current)
+    {
+        bin_to_hex(seed_hash, 32, hex);
+        log_info("RandomX seed switched to: %.16s", hex);
+        current = slot;
+        slot->retired = 0;
+    }
+    if (next_seed_hash && memcmp(next_seed_hash, seed_hash, 32))
+    {
+        next = slot_find(next_seed_hash);
+        if (!next && (next = slot_claim()))
+        {
+            bin_to_hex(next_seed_hash, 32, hex);
+            log_info("Preparing next RandomX seed: %.16s", hex);
+            slot_queue(next, next_seed_hash);
+        }
+    }
+    for (unsigned i=0; i<RX_SLOTS; i++)
+    {
+        rx_slot_t *s = &slots[i];
+        if (s == current || s == next || s->state == RX_EMPTY)
+            continue;
+        if (!s->retired)
+            s->retired = now;
+        else if (s->state == RX_READY && !s->refs
+                && now - s->retired > RX_GRACE)
+        {
+            dataset_forget(s->seed);
+            slot_release(s);
+        }
+    }
+unlock:
+    pthread_mutex_unlock(&mutex_rx);
+}
+
+int
+rx_hash(const unsigned char *seed_hash, const void *input,
+        size_t in_size, unsigned char *output)
+{
+    rx_slot_t *slot = NULL;
+
+    pthread_mutex_lock(&mutex_rx);
+    while (running)
+    {
+        slot = slot_find(seed_hash);
+        if (!slot)
+        {
+            /* Not a seed we hold, so build it and let it age out */
+            if (!(slot = slot_claim()))
+                break;
+            slot_queue(slot, seed_hash);
+            slot->retired = time(NULL);
+        }
+        if (slot->state == RX_READY)
+            break;
+        pthread_cond_wait(&cond_ready, &mutex_rx);
+        slot = NULL;
+    }
+    if (!running || !slot || (!slot->cache && !slot->dataset))
+    {
+        pthread_mutex_unlock(&mutex_rx);
+        return -1;
+    }
+    slot->refs++;
+    unsigned idx = slot - slots;
+    uint64_t gen = slot->gen;
+    randomx_cache *cache = slot->cache;
+    randomx_dataset *dataset = slot->dataset;
+    if (vm_node > -1 && slot->replica[vm_node])
+        dataset = slot->replica[vm_node];
+    pthread_mutex_unlock(&mutex_rx);
+
+    randomx_vm *vm = vms[idx];
+    if (vm && vm_gens[idx] != gen && vm_full[idx] == (dataset != NULL))
+    {
+        if (dataset)
+            randomx_vm_set_dataset(vm, dataset);
+        else
+            randomx_vm_set_cache(vm, cache);
+        vm_gens[idx] = gen;
+    }
+    else if (!vm || vm_gens[idx] != gen)
+    {
+        if (vm)
+            randomx_destroy_vm(vm);
+        randomx_flags vf = flags;
+        if (dataset)
+            vf |= RANDOMX_FLAG_FULL_MEM;
+        vm = randomx_create_vm(vf | RANDOMX_FLAG_LARGE_PAGES,
+                cache, dataset);
+        if (!vm && (vm = randomx_create_vm(vf, cache, dataset))
+                && !__atomic_exchange_n(&vm_small_pages, true,
+                    __ATOMIC_RELAXED))
+            log_warn("RandomX VMs are not using huge pages");
+        if (!vm)
+            log_error("Cannot create RandomX VM");
+        vms[idx] = vm;
+        vm_gens[idx] = gen;
+        vm_full[idx] = dataset != NULL;
+    }
+    if (vm)
+        randomx_calculate_hash(vm, input, in_size, output);
+
+    pthread_mutex_lock(&mutex_rx);
+    slot->refs--;
+    pthread_mutex_unlock(&mutex_rx);
+    return vm ? 0 : -1;
+}
+
+void
+rx_thread_free(void)
+{
+    for (unsigned i=0; i<RX_SLOTS; i++)
+    {
+        if (vms[i])
+            randomx_destroy_vm(vms[i]);
+        vms[i] = NULL;
+        vm_gens[i] = 0;
+    }
+}
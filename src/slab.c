@@ -0,0 +1,125 @@
+/*
+Copyright (c) 2018, The Monero Project
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Hands out zeroed, fixed size items carved from chunks of count items.
+  Returned items go on a free list and are reused before another chunk is
+  taken from the heap; chunks are only released when the slab is freed.
+  Not thread safe, so each slab belongs to one thread.
+*/
+
+#include "slab.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define CHUNK_HEAD 16
+
+typedef struct chunk_t chunk_t;
+struct chunk_t
+{
+    chunk_t *next;
+};
+
+struct slab_t
+{
+    size_t z;
+    size_t c;
+    chunk_t *chunks;
+    void *free;
+    slab_stats_t stats;
+};
+
+static void
+slab_grow(slab_t *s)
+{
+    chunk_t *chunk = (chunk_t*) malloc(CHUNK_HEAD + s->z * s->c);
+    char *b = (char*) chunk + CHUNK_HEAD;
+    chunk->next = s->chunks;
+    s->chunks = chunk;
+    for (size_t i=0; i<s->c; i++)
+    {
+        void *item = b + i * s->z;
+        memcpy(item, &s->free, sizeof(void*));
+        s->free = item;
+    }
+    s->stats.heap_allocs++;
+    s->stats.capacity += s->c;
+}
+
+void
+slab_new(slab_t **out, size_t size, size_t count)
+{
+    slab_t *s = (slab_t*) calloc(1, sizeof(slab_t));
+    /* Keep items 16 byte aligned for anything they may hold */
+    s->z = (size + 15) & ~(size_t)15;
+    s->c = count;
+    *out = s;
+}
+
+void
+slab_free(slab_t *s)
+{
+    chunk_t *chunk = s->chunks;
+    while (chunk)
+    {
+        chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(s);
+}
+
+void *
+slab_get(slab_t *s)
+{
+    void *item;
+    if (!s->free)
+        slab_grow(s);
+    item = s->free;
+    memcpy(&s->free, item, sizeof(void*));
+    memset(item, 0, s->z);
+    s->stats.gets++;
+    return item;
+}
+
+void
+slab_put(slab_t *s, void *item)
+{
+    memcpy(item, &s->free, sizeof(void*));
+    s->free = item;
+    s->stats.puts++;
+}
+
+void
+slab_stats(slab_t *s, slab_stats_t *stats)
+{
+    *stats = s->stats;
+}
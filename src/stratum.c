@@ -0,0 +1,347 @@
+/*
+Copyright (c) 2018, The Monero Project
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  A single pass parser for the stratum messages miners send constantly
+  (submit, getjob and keepalived). It works in place on the line as read,
+  copying only the few parameters a submit carries into fixed buffers, so
+  the hot path never allocates.
+
+  Anything it isn't sure of (escapes, nested values, numbers that aren't
+  plain integers, login and block_template) is declined, and the caller
+  parses it with json-c instead.
+*/
+
+#include "stratum.h"
+#include <string.h>
+#include <stdbool.h>
+
+#define SEEN_PARAMS  (1<<0)
+#define SEEN_NONCE   (1<<1)
+#define SEEN_RESULT  (1<<2)
+#define SEEN_JOB_ID  (1<<3)
+
+#define KEY_IS(k, n, lit) \
+    ((n) == sizeof(lit)-1 && memcmp(k, lit, sizeof(lit)-1) == 0)
+
+static const char *
+skip_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+static const char *
+scan_string(const char *p, const char *end, const char **s, size_t *n)
+{
+    if (p == end || *p != '"')
+        return NULL;
+    const char *b = ++p;
+    while (p < end && *p != '"')
+    {
+        if (*p == '\\' || (unsigned char)*p < 0x20)
+            return NULL;
+        p++;
+    }
+    if (p == end)
+        return NULL;
+    *s = b;
+    *n = p - b;
+    return p + 1;
+}
+
+static const char *
+scan_int(const char *p, const char *end, int32_t *v)
+{
+    bool neg = false;
+    int64_t r = 0;
+    unsigned digits = 0;
+    if (p < end && *p == '-')
+    {
+        neg = true;
+        p++;
+    }
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        if (++digits > 18)
+            return NULL;
+        r = r * 10 + (*p++ - '0');
+    }
+    if (!digits || (digits > 1 && *(p-digits) == '0'))
+        return NULL;
+    if (p < end && (*p == '.' || *p == 'e' || *p == 'E'))
+        return NULL;
+    if (neg)
+        r = -r;
+    /* Clamp as json_object_get_int does */
+    if (r > INT32_MAX)
+        r = INT32_MAX;
+    else if (r < INT32_MIN)
+        r = INT32_MIN;
+    *v = (int32_t) r;
+    return p;
+}
+
+static const char *
+scan_copy(const char *p, const char *end, char *out)
+{
+    const char *s = NULL;
+    size_t n = 0;
+    if (!(p = scan_string(p, end, &s, &n)) || n >= STRATUM_STR_MAX)
+        return NULL;
+    memcpy(out, s, n);
+    out[n] = 0;
+    return p;
+}
+
+static const char *
+skip_value(const char *p, const char *end)
+{
+    const char *s = NULL;
+    size_t n = 0;
+    int32_t v = 0;
+    if (p < end && *p == '"')
+        return scan_string(p, end, &s, &n);
+    return scan_int(p, end, &v);
+}
+
+static int
+method_from_name(const char *s, size_t n)
+{
+    if (KEY_IS(s, n, "submit"))
+        return STRATUM_SUBMIT;
+    if (KEY_IS(s, n, "getjob"))
+        return STRATUM_GETJOB;
+    if (KEY_IS(s, n, "keepalived"))
+        return STRATUM_KEEPALIVED;
+    if (KEY_IS(s, n, "login"))
+        return STRATUM_LOGIN;
+    if (KEY_IS(s, n, "block_template"))
+        return STRATUM_BLOCK_TEMPLATE;
+    return STRATUM_UNKNOWN;
+}
+
+static const char *
+scan_object(const char *p, const char *end, stratum_msg_t *msg,
+        unsigned *seen, bool params)
+{
+    const char *k = NULL;
+    size_t kn = 0;
+
+    if (p == end || *p++ != '{')
+        return NULL;
+    p = skip_ws(p, end);
+    if (p < end && *p == '}')
+        return p + 1;
+    for (;;)
+    {
+        if (!(p = scan_string(p, end, &k, &kn)))
+            return NULL;
+        p = skip_ws(p, end);
+        if (p == end || *p++ != ':')
+            return NULL;
+        p = skip_ws(p, end);
+        if (params)
+        {
+            if (KEY_IS(k, kn, "nonce"))
+            {
+                p = scan_copy(p, end, msg->nonce);
+                *seen |= SEEN_NONCE;
+            }
+            else if (KEY_IS(k, kn, "result"))
+            {
+                p = scan_copy(p, end, msg->result);
+                *seen |= SEEN_RESULT;
+            }
+            else if (KEY_IS(k, kn, "job_id"))
+            {
+                p = scan_copy(p, end, msg->job_id);
+                *seen |= SEEN_JOB_ID;
+            }
+            else if (KEY_IS(k, kn, "poolNonce"))
+                p = scan_int(p, end, &msg->pool_nonce);
+            else if (KEY_IS(k, kn, "workerNonce"))
+                p = scan_int(p, end, &msg->worker_nonce);
+            else
+                p = skip_value(p, end);
+        }
+        else if (KEY_IS(k, kn, "params"))
+        {
+            p = scan_object(p, end, msg, seen, true);
+            *seen |= SEEN_PARAMS;
+        }
+        else if (KEY_IS(k, kn, "method"))
+        {
+            const char *s = NULL;
+            size_t n = 0;
+            if ((p = scan_string(p, end, &s, &n)))
+                msg->method = method_from_name(s, n);
+        }
+        else if (KEY_IS(k, kn, "id"))
+            p = scan_int(p, end, &msg->id);
+        else
+            p = skip_value(p, end);
+        if (!p)
+            return NULL;
+        p = skip_ws(p, end);
+        if (p == end)
+            return NULL;
+        if (*p == ',')
+        {
+            p = skip_ws(p + 1, end);
+            continue;
+        }
+        if (*p++ == '}')
+            return p;
+        return NULL;
+    }
+}
+
+static void
+submit_check(stratum_msg_t *msg, unsigned seen)
+{
+    if (msg->method != STRATUM_SUBMIT)
+        return;
+    if (!(seen & SEEN_PARAMS))
+        msg->error = "params not found";
+    else if (!(seen & SEEN_NONCE))
+        msg->error = "nonce not found";
+    else if (!(seen & SEEN_RESULT))
+        msg->error = "result not found";
+    else if (!(seen & SEEN_JOB_ID))
+        msg->error = "job_id not found";
+}
+
+static void
+msg_reset(stratum_msg_t *msg)
+{
+    msg->method = STRATUM_UNKNOWN;
+    msg->id = 0;
+    msg->nonce[0] = 0;
+    msg->result[0] = 0;
+    msg->job_id[0] = 0;
+    msg->pool_nonce = 0;
+    msg->worker_nonce = 0;
+    msg->error = NULL;
+}
+
+int
+stratum_parse(const char *line, size_t len, stratum_msg_t *msg)
+{
+    const char *end = line + len;
+    const char *p = skip_ws(line, end);
+    unsigned seen = 0;
+
+    msg_reset(msg);
+    if (!(p = scan_object(p, end, msg, &seen, false)))
+        return -1;
+    if (skip_ws(p, end) != end)
+        return -1;
+    if (msg->method == STRATUM_LOGIN
+            || msg->method == STRATUM_BLOCK_TEMPLATE)
+        return -1;
+    submit_check(msg, seen);
+    return 0;
+}
+
+static int
+json_copy(json_object *params, const char *name, char *out,
+        const char **error)
+{
+    json_object *v = NULL;
+    if (!json_object_object_get_ex(params, name, &v))
+        return -1;
+    if (!json_object_is_type(v, json_type_string))
+    {
+        *error = "not a json_type_string";
+        return -1;
+    }
+    const char *s = json_object_get_string(v);
+    size_t n = strlen(s);
+    if (n >= STRATUM_STR_MAX)
+        n = STRATUM_STR_MAX - 1;
+    memcpy(out, s, n);
+    out[n] = 0;
+    return 0;
+}
+
+void
+stratum_from_json(json_object *message, stratum_msg_t *msg)
+{
+    json_object *method = NULL, *id = NULL, *params = NULL, *v = NULL;
+    const char *type_error = NULL;
+
+    msg_reset(msg);
+    if (json_object_object_get_ex(message, "method", &method))
+    {
+        const char *name = json_object_get_string(method);
+        if (name)
+            msg->method = method_from_name(name, strlen(name));
+    }
+    if (json_object_object_get_ex(message, "id", &id))
+        msg->id = json_object_get_int(id);
+    if (msg->method != STRATUM_SUBMIT)
+        return;
+
+    if (!json_object_object_get_ex(message, "params", &params))
+    {
+        msg->error = "params not found";
+        return;
+    }
+    if (!json_object_is_type(params, json_type_object))
+    {
+        msg->error = "params not a json_type_object";
+        return;
+    }
+    if (json_copy(params, "nonce", msg->nonce, &type_error))
+    {
+        msg->error = type_error ? "nonce not a json_type_string"
+            : "nonce not found";
+        return;
+    }
+    if (json_copy(params, "result", msg->result, &type_error))
+    {
+        msg->error = type_error ? "result not a json_type_string"
+            : "result not found";
+        return;
+    }
+    if (json_copy(params, "job_id", msg->job_id, &type_error))
+    {
+        msg->error = type_error ? "job_id not a json_type_string"
+            : "job_id not found";
+        return;
+    }
+    if (json_object_object_get_ex(params, "poolNonce", &v))
+        msg->pool_nonce = json_object_get_int(v);
+    if (json_object_object_get_ex(params, "workerNonce", &v))
+        msg->worker_nonce = json_object_get_int(v);
+}
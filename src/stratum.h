@@ -0,0 +1,68 @@
+/*
+Copyright (c) 2018, The Monero Project
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Stratum message parsing */
+
+#ifndef STRATUM_H
+#define STRATUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <json-c/json.h>
+
+#define STRATUM_STR_MAX 72
+
+enum stratum_method
+{
+    STRATUM_UNKNOWN,
+    STRATUM_LOGIN,
+    STRATUM_SUBMIT,
+    STRATUM_GETJOB,
+    STRATUM_KEEPALIVED,
+    STRATUM_BLOCK_TEMPLATE
+};
+
+typedef struct stratum_msg_t
+{
+    int method;
+    int id;
+    char nonce[STRATUM_STR_MAX];
+    char result[STRATUM_STR_MAX];
+    char job_id[STRATUM_STR_MAX];
+    int32_t pool_nonce;
+    int32_t worker_nonce;
+    const char *error;
+} stratum_msg_t;
+
+int stratum_parse(const char *line, size_t len, stratum_msg_t *msg);
+void stratum_from_json(json_object *message, stratum_msg_t *msg);
+
+#endif
@@ -36,9 +36,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <errno.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 
 #include "util.h"
 
+#define NUMA_SYSFS "/sys/devices/system/node"
+
 int
 is_hex_string(const char *str)
 {
@@ -146,3 +151,96 @@ write_varint(unsigned char *b, uint64_t v)
     return ++b;
 }
 
+
+unsigned
+numa_nodes(void)
+{
+    char path[64];
+    unsigned n = 0;
+    while (n < NUMA_NODES_MAX)
+    {
+        snprintf(path, sizeof(path), NUMA_SYSFS "/node%u", n);
+        if (access(path, F_OK))
+            break;
+        n++;
+    }
+    return n ? n : 1;
+}
+
+int
+numa_pin(unsigned node)
+{
+    char path[64];
+    char list[4096] = {0};
+    cpu_set_t set;
+    snprintf(path, sizeof(path), NUMA_SYSFS "/node%u/cpulist", node);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    size_t r = fread(list, 1, sizeof(list)-1, fp);
+    fclose(fp);
+    list[r] = 0;
+
+    /* A cpulist is comma separated CPUs and ranges, e.g. 0-7,16-23 */
+    CPU_ZERO(&set);
+    char *cp = list;
+    while (*cp && *cp != '\n')
+    {
+        char *end = NULL;
+        unsigned long lo = strtoul(cp, &end, 10);
+        unsigned long hi = lo;
+        if (end == cp)
+            return -1;
+        if (*end == '-')
+        {
+            cp = end + 1;
+            hi = strtoul(cp, &end, 10);
+        }
+        for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+            CPU_SET(lo, &set);
+        cp = *end == ',' ? end + 1 : end;
+    }
+    if (!CPU_COUNT(&set))
+        return -1;
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+uint64_t
+numa_free_kb(unsigned node)
+{
+    char path[96];
+    char line[256];
+    uint64_t free_kb = 0;
+    uint64_t pages = 0;
+    snprintf(path, sizeof(path), NUMA_SYSFS "/node%u/meminfo", node);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *cp = strstr(line, "MemFree:");
+        if (cp)
+            free_kb = strtoull(cp + 8, NULL, 10);
+    }
+    fclose(fp);
+    snprintf(path, sizeof(path), NUMA_SYSFS
+            "/node%u/hugepages/hugepages-2048kB/free_hugepages", node);
+    if ((fp = fopen(path, "r")))
+    {
+        if (fscanf(fp, "%"SCNu64, &pages) != 1)
+            pages = 0;
+        fclose(fp);
+    }
+    return free_kb + pages * 2048;
+}
+
+int
+numa_node_of(const void *addr)
+{
+    /* move_pages with no target nodes only reports where pages are */
+    void *pages[1] = { (void*)((uintptr_t)addr & ~(uintptr_t)4095) };
+    int status[1] = { -1 };
+    if (syscall(SYS_move_pages, 0, 1, pages, NULL, status, 0))
+        return -1;
+    return status[0];
+}
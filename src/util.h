@@ -32,6 +32,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef UTIL_H
 #define UTIL_H
 
+#define NUMA_NODES_MAX 8
+
 int is_hex_string(const char *str);
 void hex_to_bin(const char *hex, unsigned char *bin, const size_t bin_size);
 void bin_to_hex(const unsigned char *bin, const size_t bin_size, char *hex);
@@ -40,5 +42,9 @@ char * stecpy(char *dst, const char *src, const char *end);
 char * trim(char *str);
 uint64_t read_varint(const unsigned char *b);
 unsigned char * write_varint(unsigned char *b, uint64_t v);
+unsigned numa_nodes(void);
+int numa_pin(unsigned node);
+uint64_t numa_free_kb(unsigned node);
+int numa_node_of(const void *addr);
 
 #endif
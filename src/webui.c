@@ -156,6 +156,65 @@ send_json_stats(struct evhttp_request *req, void *arg)
     evhttp_send_reply(req, HTTP_OK, "OK", buf);
 }
 
+static void
+send_json_metrics(struct evhttp_request *req, void *arg)
+{
+    struct evbuffer *buf = evhttp_request_get_output_buffer(req);
+    wui_context_t *context = (wui_context_t*) arg;
+    pool_metrics_t *pm = context->pool_metrics;
+    struct evkeyvalq *hdrs_out = NULL;
+    uint64_t sc = pm->share_commits;
+    uint64_t sca = sc ? pm->shares_committed / sc : 0;
+
+    evbuffer_add_printf(buf, "{"
+            "\"share_commits\":%"PRIu64","
+            "\"shares_committed\":%"PRIu64","
+            "\"share_commit_size\":%"PRIu64","
+            "\"share_commit_size_avg\":%"PRIu64","
+            "\"share_commit_latency_us\":%"PRIu64","
+            "\"shares_verified\":%"PRIu64","
+            "\"shares_prefiltered\":%"PRIu64","
+            "\"shares_duplicate\":%"PRIu64","
+            "\"submission_allocs\":%"PRIu64","
+            "\"submission_heap_allocs\":%"PRIu64","
+            "\"messages_parsed\":%"PRIu64","
+            "\"messages_fallback\":%"PRIu64","
+            "\"broadcasts\":%"PRIu64","
+            "\"broadcast_clients\":%"PRIu64","
+            "\"broadcast_time_us\":%"PRIu64","
+            "\"broadcast_time_max_us\":%"PRIu64","
+            "\"payouts\":%"PRIu64","
+            "\"payout_rows\":%"PRIu64","
+            "\"payout_addresses\":%"PRIu64","
+            "\"payout_time_us\":%"PRIu64","
+            "\"shares_culled\":%"PRIu64","
+            "\"cull_height\":%"PRIu64
+            ",\"verify_nodes\":[", sc, pm->shares_committed,
+            pm->share_commit_size, sca,
+            pm->share_commit_latency, pm->shares_verified,
+            pm->shares_prefiltered, pm->shares_duplicate,
+            pm->submission_allocs, pm->submission_heap_allocs,
+            pm->messages_parsed, pm->messages_fallback, pm->broadcasts,
+            pm->broadcast_clients, pm->broadcast_time,
+            pm->broadcast_time_max, pm->payouts, pm->payout_rows,
+            pm->payout_addresses, pm->payout_time, pm->shares_culled,
+            pm->cull_height);
+    for (unsigned i=0, n=0; i<VERIFY_NODES_MAX; i++)
+    {
+        uint64_t h = pm->node_hashes[i];
+        uint64_t t = pm->node_hash_time[i];
+        if (!h)
+            continue;
+        evbuffer_add_printf(buf, "%s{\"node\":%u,\"hashes\":%"PRIu64","
+                "\"busy_hashes_per_sec\":%.1f}", n++ ? "," : "", i, h,
+                t ? h * 1000000.0 / t : 0.0);
+    }
+    evbuffer_add(buf, "]}", 2);
+    hdrs_out = evhttp_request_get_output_headers(req);
+    evhttp_add_header(hdrs_out, "Content-Type", "application/json");
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
+}
+
 static void
 process_request(struct evhttp_request *req, void *arg)
 {
@@ -175,6 +234,12 @@ process_request(struct evhttp_request *req, void *arg)
         return;
     }
 
+    if (strstr(url, "/metrics") != NULL)
+    {
+        send_json_metrics(req, arg);
+        return;
+    }
+
     buf = evhttp_request_get_output_buffer(req);
     evbuffer_add(buf, webui_html, webui_html_len);
     hdrs_out = evhttp_request_get_output_headers(req);
@@ -45,11 +45,41 @@ typedef struct pool_stats_t
     time_t last_template_fetched;
 } pool_stats_t;
 
+#define VERIFY_NODES_MAX 8
+
+typedef struct pool_metrics_t
+{
+    uint64_t share_commits;
+    uint64_t shares_committed;
+    uint64_t share_commit_size;
+    uint64_t share_commit_latency;
+    uint64_t shares_verified;
+    uint64_t shares_prefiltered;
+    uint64_t shares_duplicate;
+    uint64_t submission_allocs;
+    uint64_t submission_heap_allocs;
+    uint64_t messages_parsed;
+    uint64_t messages_fallback;
+    uint64_t broadcasts;
+    uint64_t broadcast_clients;
+    uint64_t broadcast_time;
+    uint64_t broadcast_time_max;
+    uint64_t payouts;
+    uint64_t payout_rows;
+    uint64_t payout_addresses;
+    uint64_t payout_time;
+    uint64_t shares_culled;
+    uint64_t cull_height;
+    uint64_t node_hashes[VERIFY_NODES_MAX];
+    uint64_t node_hash_time[VERIFY_NODES_MAX];
+} pool_metrics_t;
+
 typedef struct wui_context_t
 {
     char listen[256];
     uint16_t port;
     pool_stats_t *pool_stats;
+    pool_metrics_t *pool_metrics;
     double pool_fee;
     double payment_threshold;
     uint16_t pool_port;
@@ -0,0 +1,190 @@
+/*
+Copyright (c) 2018, The Monero Project
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Items pushed are handed to work() on one of the pool threads, then queued
+  back and handed to done() on the thread running the event base. Both
+  queues are lock-free; the mutex is only taken to park and wake idle
+  threads.
+*/
+
+#include "wpool.h"
+#include "lfq.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <event2/event.h>
+
+struct wpool_t
+{
+    lfq_t *in;
+    lfq_t *out;
+    size_t max;
+    size_t inflight;
+    unsigned n;
+    unsigned started;
+    unsigned sleepers;
+    bool running;
+    pthread_t *th;
+    pthread_mutex_t mx;
+    pthread_cond_t cv;
+    struct event *ev;
+    wpool_fun work;
+    wpool_fun done;
+    wpool_hook start;
+    wpool_hook stop;
+};
+
+static void
+wpool_on_done(evutil_socket_t fd, short kind, void *ctx)
+{
+    wpool_t *wp = (wpool_t*) ctx;
+    void *item;
+    while ((item = lfq_pop(wp->out)))
+    {
+        __atomic_sub_fetch(&wp->inflight, 1, __ATOMIC_RELAXED);
+        wp->done(item);
+    }
+}
+
+static void *
+wpool_main(void *ctx)
+{
+    wpool_t *wp = (wpool_t*) ctx;
+    unsigned idx = __atomic_fetch_add(&wp->started, 1, __ATOMIC_RELAXED);
+    if (wp->start)
+        wp->start(idx);
+    while (1)
+    {
+        void *item = lfq_pop(wp->in);
+        if (!item)
+        {
+            pthread_mutex_lock(&wp->mx);
+            __atomic_add_fetch(&wp->sleepers, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&wp->running, __ATOMIC_SEQ_CST)
+                    && !(item = lfq_pop(wp->in)))
+                pthread_cond_wait(&wp->cv, &wp->mx);
+            __atomic_sub_fetch(&wp->sleepers, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&wp->mx);
+            if (!item)
+                break;
+        }
+        wp->work(item);
+        lfq_push(wp->out, item);
+        event_active(wp->ev, EV_READ, 0);
+    }
+    if (wp->stop)
+        wp->stop(idx);
+    return NULL;
+}
+
+int
+wpool_new(wpool_t **out, struct event_base *base, unsigned threads,
+        size_t count, wpool_fun work, wpool_fun done,
+        wpool_hook start, wpool_hook stop)
+{
+    wpool_t *wp = (wpool_t*) calloc(1, sizeof(wpool_t));
+    int rc = 0;
+    lfq_new(&wp->in, count);
+    lfq_new(&wp->out, count);
+    wp->max = count;
+    wp->work = work;
+    wp->done = done;
+    wp->start = start;
+    wp->stop = stop;
+    wp->running = true;
+    pthread_mutex_init(&wp->mx, NULL);
+    pthread_cond_init(&wp->cv, NULL);
+    wp->ev = event_new(base, -1, 0, wpool_on_done, wp);
+    wp->th = (pthread_t*) calloc(threads, sizeof(pthread_t));
+    for (; wp->n < threads; wp->n++)
+    {
+        if ((rc = pthread_create(&wp->th[wp->n], NULL, wpool_main, wp)))
+            break;
+    }
+    *out = wp;
+    if (rc)
+    {
+        wpool_free(wp);
+        *out = NULL;
+    }
+    return rc;
+}
+
+void
+wpool_free(wpool_t *wp)
+{
+    void *item;
+    pthread_mutex_lock(&wp->mx);
+    __atomic_store_n(&wp->running, false, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&wp->cv);
+    pthread_mutex_unlock(&wp->mx);
+    for (unsigned i=0; i<wp->n; i++)
+        pthread_join(wp->th[i], NULL);
+    /* Anything left over is handed back, worked or not */
+    while ((item = lfq_pop(wp->out)))
+        wp->done(item);
+    while ((item = lfq_pop(wp->in)))
+        wp->done(item);
+    event_free(wp->ev);
+    lfq_free(wp->in);
+    lfq_free(wp->out);
+    pthread_mutex_destroy(&wp->mx);
+    pthread_cond_destroy(&wp->cv);
+    free(wp->th);
+    free(wp);
+}
+
+int
+wpool_push(wpool_t *wp, void *item)
+{
+    if (__atomic_add_fetch(&wp->inflight, 1, __ATOMIC_RELAXED) > wp->max)
+    {
+        __atomic_sub_fetch(&wp->inflight, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    lfq_push(wp->in, item);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&wp->sleepers, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&wp->mx);
+        pthread_cond_signal(&wp->cv);
+        pthread_mutex_unlock(&wp->mx);
+    }
+    return 0;
+}
+
+unsigned
+wpool_threads(wpool_t *wp)
+{
+    return wp->n;
+}
@@ -34,6 +34,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <mutex>
 
 #include "cryptonote_basic/cryptonote_basic.h"
 #include "cryptonote_basic/cryptonote_format_utils.h"
@@ -46,6 +47,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "ringct/rctSigs.h"
 #include "common/base58.h"
 #include "common/util.h"
+#include "common/varint.h"
 #include "string_tools.h"
 
 #include "xmr.h"
@@ -55,6 +57,24 @@ using namespace cryptonote;
 using namespace crypto;
 using namespace config;
 
+/*
+  Self-select templates from miners behind the same daemon mostly share a
+  miner tx, so the outcome of deriving its output key is kept per tx public
+  key (R) and output key (P), against the pool's fixed view and spend keys.
+*/
+#define DERIVATION_CACHE_SIZE 256
+
+struct derivation_entry
+{
+    bool used;
+    public_key R;
+    public_key P;
+    bool match;
+};
+
+static derivation_entry derivation_cache[DERIVATION_CACHE_SIZE];
+static std::mutex derivation_mutex;
+
 static int nettype_from_prefix(uint8_t *nettype, uint64_t prefix)
 {
     static const struct { cryptonote::network_type type; uint64_t prefix; } nettype_prefix[] = {
@@ -98,6 +118,177 @@ int get_hashing_blob(const unsigned char *input, const size_t in_size,
     return XMR_NO_ERROR;
 }
 
+/*
+  A hashing template holds everything of a block template needed to produce
+  the block hashing blob, bar the miner tx prefix hash. Changing the reserved
+  bytes in the miner tx extra then only costs a hash of the prefix plus one
+  hash per level of the tx merkle tree (using the branch to the miner tx).
+*/
+struct hashing_template_t
+{
+    std::string header;
+    std::string prefix;
+    size_t prefix_offset;
+    size_t version;
+    std::string suffix;
+    hash tail[2];
+    std::vector<hash> branch;
+    std::string count;
+};
+
+static size_t tree_branch(const std::vector<hash> &hashes,
+        std::vector<hash> &branch)
+{
+    /*
+      Mirrors tree_hash(), collecting the sibling on the path of the first
+      (miner tx) leaf, which is always the left node.
+    */
+    size_t count = hashes.size();
+    branch.clear();
+    if (count == 1)
+        return 0;
+    if (count == 2)
+    {
+        branch.push_back(hashes[1]);
+        return 1;
+    }
+    size_t cnt = 2;
+    while (cnt < count)
+        cnt <<= 1;
+    cnt >>= 1;
+    std::vector<hash> ints(cnt);
+    size_t i, j;
+    memcpy(ints.data(), hashes.data(), (2 * cnt - count) * sizeof(hash));
+    if (2 * cnt == count)
+        branch.push_back(hashes[1]);
+    for (i = 2 * cnt - count, j = 2 * cnt - count; j < cnt; i += 2, ++j)
+        cn_fast_hash(&hashes[i], 2 * sizeof(hash), ints[j]);
+    while (cnt > 2)
+    {
+        branch.push_back(ints[1]);
+        cnt >>= 1;
+        for (i = 0, j = 0; j < cnt; i += 2, ++j)
+            cn_fast_hash(&ints[i], 2 * sizeof(hash), ints[j]);
+    }
+    branch.push_back(ints[1]);
+    return branch.size();
+}
+
+static void miner_tx_hash(const hashing_template_t *ht,
+        const std::string &prefix, hash &out)
+{
+    if (ht->version == 1)
+    {
+        std::string tx = prefix + ht->suffix;
+        cn_fast_hash(tx.data(), tx.size(), out);
+        return;
+    }
+    hash hashes[3];
+    cn_fast_hash(prefix.data(), prefix.size(), hashes[0]);
+    hashes[1] = ht->tail[0];
+    hashes[2] = ht->tail[1];
+    cn_fast_hash(hashes, sizeof(hashes), out);
+}
+
+static void hashing_blob_from(const hashing_template_t *ht,
+        const std::string &prefix, unsigned char *output, size_t *out_size)
+{
+    hash root;
+    miner_tx_hash(ht, prefix, root);
+    for (const hash &h : ht->branch)
+    {
+        hash pair[2] = {root, h};
+        cn_fast_hash(pair, sizeof(pair), root);
+    }
+    unsigned char *p = output;
+    memcpy(p, ht->header.data(), ht->header.size());
+    p += ht->header.size();
+    memcpy(p, &root, sizeof(root));
+    p += sizeof(root);
+    memcpy(p, ht->count.data(), ht->count.size());
+    p += ht->count.size();
+    *out_size = p - output;
+}
+
+int get_hashing_template(const unsigned char *input, const size_t in_size,
+        hashing_template_t **output)
+{
+    block b = AUTO_VAL_INIT(b);
+    blobdata bd = std::string((const char*)input, in_size);
+    if (!parse_and_validate_block_from_blob(bd, b))
+        return XMR_PARSE_ERROR;
+
+    hashing_template_t *ht = new hashing_template_t();
+    const transaction &tx = b.miner_tx;
+    blobdata tx_blob = t_serializable_object_to_blob(tx);
+    ht->header = t_serializable_object_to_blob(
+            static_cast<const block_header&>(b));
+    ht->prefix = t_serializable_object_to_blob(
+            static_cast<const transaction_prefix&>(tx));
+    ht->prefix_offset = ht->header.size();
+    ht->version = tx.version;
+    ht->suffix = tx_blob.substr(ht->prefix.size());
+    if (ht->version > 1)
+    {
+        if (tx.rct_signatures.type != rct::RCTTypeNull)
+            goto mismatch;
+        cn_fast_hash(ht->suffix.data(), ht->suffix.size(), ht->tail[0]);
+        ht->tail[1] = null_hash;
+    }
+    if (bd.compare(ht->prefix_offset, tx_blob.size(), tx_blob) != 0)
+        goto mismatch;
+
+    {
+        std::vector<hash> hashes;
+        hashes.reserve(b.tx_hashes.size() + 1);
+        hashes.push_back(get_transaction_hash(tx));
+        hashes.insert(hashes.end(), b.tx_hashes.begin(), b.tx_hashes.end());
+        tree_branch(hashes, ht->branch);
+        tools::write_varint(std::back_inserter(ht->count), hashes.size());
+    }
+
+    {
+        /* Must reproduce exactly what a full parse would */
+        blobdata expected = get_block_hashing_blob(b);
+        unsigned char blob[HASHING_BLOB_MAX];
+        size_t blob_size = 0;
+        if (ht->header.size() + sizeof(hash) + ht->count.size()
+                > HASHING_BLOB_MAX)
+            goto mismatch;
+        hashing_blob_from(ht, ht->prefix, blob, &blob_size);
+        if (expected.size() != blob_size
+                || memcmp(expected.data(), blob, blob_size))
+            goto mismatch;
+    }
+
+    *output = ht;
+    return XMR_NO_ERROR;
+
+mismatch:
+    delete ht;
+    return XMR_MISMATCH_ERROR;
+}
+
+void free_hashing_template(hashing_template_t *ht)
+{
+    delete ht;
+}
+
+int get_job_hashing_blob(const hashing_template_t *ht, size_t offset,
+        const unsigned char *patch, size_t patch_size,
+        unsigned char *output, size_t *out_size)
+{
+    static thread_local std::string prefix;
+    if (offset < ht->prefix_offset
+            || offset + patch_size > ht->prefix_offset + ht->prefix.size())
+        return XMR_MISMATCH_ERROR;
+    prefix.assign(ht->prefix);
+    prefix.replace(offset - ht->prefix_offset, patch_size,
+            (const char*)patch, patch_size);
+    hashing_blob_from(ht, prefix, output, out_size);
+    return XMR_NO_ERROR;
+}
+
 int parse_address(const char *input, uint64_t *prefix,
         uint8_t *nettype, unsigned char *pub_spend)
 {
@@ -146,20 +337,8 @@ void get_hash(const unsigned char *input, const size_t in_size,
             reinterpret_cast<hash&>(*output), variant, height);
 }
 
-void set_rx_main_seedhash(const unsigned char *seed_hash)
-{
-    static unsigned init_threads = tools::get_max_concurrency();
-    rx_set_main_seedhash((const char*)seed_hash, init_threads);
-}
-
-void get_rx_hash(const unsigned char *seed_hash, const unsigned char *input,
-        const size_t in_size, unsigned char *output)
-{
-    rx_slow_hash((const char*)seed_hash, (const void*)input, in_size,
-            (char*)output);
-}
-
-int validate_block_from_blob(const char *blob_hex,
+int validate_block_from_blob(const unsigned char *blob,
+        const size_t blob_size,
         const unsigned char *sec_view,
         const unsigned char *pub_spend)
 {
@@ -168,13 +347,10 @@ int validate_block_from_blob(const char *blob_hex,
       miner tx only pays out to the pool.
     */
     block b = AUTO_VAL_INIT(b);
-    blobdata bd;
+    blobdata bd = std::string((const char*)blob, blob_size);
     const secret_key &v = *reinterpret_cast<const secret_key*>(sec_view);
     const public_key &S = *reinterpret_cast<const public_key*>(pub_spend);
 
-    if (!parse_hexstr_to_binbuff(blob_hex, bd))
-        return XMR_PARSE_ERROR;
-
     if (!parse_and_validate_block_from_blob(bd, b))
         return XMR_PARSE_ERROR;
 
@@ -207,11 +383,26 @@ int validate_block_from_blob(const char *blob_hex,
         return XMR_TX_EXTRA_ERROR;
     public_key R = pub_key_field.pub_key;
     public_key P = boost::get<txout_to_tagged_key>(tx.vout[0].target).key;
+    unsigned slot = (uint8_t)R.data[0] | (uint8_t)R.data[1] << 8;
+    derivation_entry &e = derivation_cache[slot % DERIVATION_CACHE_SIZE];
+    {
+        std::lock_guard<std::mutex> lock(derivation_mutex);
+        if (e.used && e.R == R && e.P == P)
+            return e.match ? XMR_NO_ERROR : XMR_MISMATCH_ERROR;
+    }
     key_derivation derivation;
     generate_key_derivation(R, v, derivation);
     public_key derived;
     derive_subaddress_public_key(P, derivation, 0, derived);
-    if (derived != S)
+    bool match = derived == S;
+    {
+        std::lock_guard<std::mutex> lock(derivation_mutex);
+        e.used = true;
+        e.R = R;
+        e.P = P;
+        e.match = match;
+    }
+    if (!match)
         return XMR_MISMATCH_ERROR;
 
     return XMR_NO_ERROR;
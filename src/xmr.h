@@ -47,8 +47,18 @@ enum xmr_error
     XMR_MISMATCH_ERROR   = -6
 };
 
+#define HASHING_BLOB_MAX 128
+
+typedef struct hashing_template_t hashing_template_t;
+
 int get_hashing_blob(const unsigned char *input, const size_t in_size,
         unsigned char **output, size_t *out_size);
+int get_hashing_template(const unsigned char *input, const size_t in_size,
+        hashing_template_t **output);
+void free_hashing_template(hashing_template_t *ht);
+int get_job_hashing_blob(const hashing_template_t *ht, size_t offset,
+        const unsigned char *patch, size_t patch_size,
+        unsigned char *output, size_t *out_size);
 int parse_address(const char *input, uint64_t *prefix,
         uint8_t *nettype, unsigned char *pub_spend);
 int is_integrated(uint64_t prefix);
@@ -56,11 +66,8 @@ int get_block_hash(const unsigned char *input, const size_t in_size,
         unsigned char *output);
 void get_hash(const unsigned char *input, const size_t in_size,
         unsigned char *output, int variant, uint64_t height);
-void set_rx_main_seedhash(const unsigned char *seed_hash);
-void get_rx_hash(const unsigned char *seed_hash, const unsigned char *input,
-        const size_t in_size, unsigned char *output);
-int validate_block_from_blob(const char *blob_hex,
-        const unsigned char *sec_view,
+int validate_block_from_blob(const unsigned char *blob,
+        const size_t blob_size, const unsigned char *sec_view,
         const unsigned char *pub_spend);
 
 #ifdef __cplusplus